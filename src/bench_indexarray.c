@@ -0,0 +1,271 @@
+/// @file:  bench_indexarray.c
+///
+/// Timing and property checks for the index arrays.
+///
+/// The property check drives array_insert, array_delete, array_swap_elem,
+/// array_move_elem and array_bisect with a seeded random sequence and compares
+/// every step against a plain reference array.  The benchmarks replay the
+/// access pattern mapdata_erode puts on pending_by_height: a queue kept sorted
+/// from highest to lowest, popped from the tail, fed with cells a little above
+/// the current low point, and re-sorted when a queued cell is lowered.
+///
+/// Usage:  bench_indexarray [seed [max_size]]
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "maptypes.h"
+#include "indexarray.h"
+#include "maprand.h"
+
+double _now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void _require(error_type e) {
+  if(e) {
+    printf("FAIL:  array operation returned error %d\n", e);
+    exit(2);
+  }
+}
+
+void _check_fail(const char *what, size_t step) {
+  printf("FAIL:  %s mismatch at step %ld\n", what, step);
+  exit(1);
+}
+
+// Reference model: a bare array manipulated one element at a time.
+typedef struct {
+  size_t size;
+  size_t *data;
+} _ref_type;
+
+void _ref_insert(_ref_type *ref, size_t idx, size_t value) {
+  for(size_t i = ref->size; i > idx; --i) ref->data[i] = ref->data[i - 1];
+  ref->data[idx] = value;
+  ref->size += 1;
+}
+
+void _ref_delete(_ref_type *ref, size_t idx) {
+  for(size_t i = idx; i + 1 < ref->size; ++i) ref->data[i] = ref->data[i + 1];
+  ref->size -= 1;
+}
+
+size_t _ref_move(_ref_type *ref, size_t src_idx, size_t dst_idx) {
+  size_t value = ref->data[src_idx];
+  _ref_delete(ref, src_idx);
+  if(dst_idx > src_idx) dst_idx -= 1;
+  _ref_insert(ref, dst_idx, value);
+  return dst_idx;
+}
+
+size_t _ref_lower_bound(_ref_type *ref, size_t value) {
+  size_t idx = 0;
+  while(idx < ref->size && ref->data[idx] < value) ++idx;
+  return idx;
+}
+
+void _compare(array_type *array, _ref_type *ref, size_t step) {
+  if(array->size != ref->size) _check_fail("size", step);
+  if(array->capacity < array->size) _check_fail("capacity", step);
+  if(memcmp(array->data, ref->data, ref->size * sizeof(size_t))) _check_fail("contents", step);
+}
+
+void property_check(uint64_t seed, size_t steps) {
+  rand_type rng;
+  array_type *array;
+  _ref_type ref;
+
+  rand_stream(&rng, seed, 1);
+  ref.size = 0;
+  ref.data = malloc(steps * sizeof(size_t));
+  _require(array_init(&array, 1));
+
+  // Unordered edits.
+  for(size_t step = 0; step < steps; ++step) {
+    size_t op = rand_below(&rng, 8);
+    if(ref.size == 0 || op < 3) {
+      size_t idx = rand_below(&rng, ref.size + 1);
+      _require(array_insert(&array, idx, step));
+      _ref_insert(&ref, idx, step);
+    } else if(op < 5) {
+      size_t idx = rand_below(&rng, ref.size);
+      _require(array_delete(&array, idx));
+      _ref_delete(&ref, idx);
+    } else if(op < 6) {
+      size_t idx0 = rand_below(&rng, ref.size);
+      size_t idx1 = rand_below(&rng, ref.size);
+      size_t vtmp = ref.data[idx0];
+      _require(array_swap_elem(&array, idx0, idx1));
+      ref.data[idx0] = ref.data[idx1];
+      ref.data[idx1] = vtmp;
+    } else {
+      size_t src_idx = rand_below(&rng, ref.size);
+      size_t dst_idx = rand_below(&rng, ref.size + 1);
+      if(array_move_elem(&array, src_idx, dst_idx) != _ref_move(&ref, src_idx, dst_idx)) {
+        _check_fail("move_elem result", step);
+      }
+    }
+    _compare(array, &ref, step);
+  }
+
+  // Sorted edits through array_bisect.
+  array->size = 0;
+  ref.size = 0;
+  for(size_t step = 0; step < steps; ++step) {
+    size_t value = rand_below(&rng, steps / 4 + 1);
+    size_t lb = array_bisect(&array, idx_lt_bound, &value);
+    size_t ub = array_bisect(&array, idx_ngt_bound, &value);
+    if(lb != _ref_lower_bound(&ref, value)) _check_fail("bisect lt", step);
+    if(ub != _ref_lower_bound(&ref, value + 1)) _check_fail("bisect ngt", step);
+    if(rand_below(&rng, 3) && lb != ub) {
+      _require(array_delete(&array, lb));
+      _ref_delete(&ref, lb);
+    } else {
+      _require(array_insert(&array, ub, value));
+      _ref_insert(&ref, ub, value);
+    }
+    _compare(array, &ref, step);
+  }
+
+  printf("Property check:  %ld steps passed (seed %lu)\n", steps, (unsigned long)seed);
+
+  array_free(&array);
+  free(ref.data);
+}
+
+// Fill 'array' with 'size' cells sorted from highest to lowest, the way
+// pending_by_height is kept.
+void _fill_queue(array_type **array, mapdata_type *md, size_t size) {
+  (*array)->size = 0;
+  for(size_t idx = 0; idx < size; ++idx) {
+    md->data[idx].elevation = (double)(size - idx);
+    _require(array_insert(array, idx, idx));
+  }
+}
+
+// A new cell lands a little above the current low point, i.e. near the tail.
+double _near_tail_height(rand_type *rng, array_type *array, mapdata_type *md) {
+  double low = md->data[array->data[array->size - 1]].elevation;
+  return low - 64.0 * log(1.0 - rand_unit(rng));
+}
+
+// Inserts and pops per turn in bench_size.
+#define BENCH_BATCH 64
+
+void bench_size(rand_type *rng, size_t size, size_t ops) {
+  mapdata_type md;
+  array_type *array;
+  curry_type cd;
+  double t0, t1;
+  double insert_ns = 0, pop_ns = 0;
+  size_t next_cell;
+
+  md.data = calloc(size + ops, sizeof(datum_type));
+  if(NULL == md.data) _require(BUF_ALLOC_ERROR);
+  cd.md = &md;
+  _require(array_init(&array, size + ops));
+  next_cell = size;
+
+  // Sorted-by-height inserts, with the bisect that finds their place, and
+  // pops from the tail, timed apart but taken in turns of BENCH_BATCH so the
+  // queue stays at 'size' give or take a batch.
+  _fill_queue(&array, &md, size);
+  for(size_t done = 0; done < ops; done += BENCH_BATCH) {
+    size_t count = ops - done < BENCH_BATCH ? ops - done : BENCH_BATCH;
+    t0 = _now_ns();
+    for(size_t op = 0; op < count; ++op) {
+      size_t cell = next_cell++;
+      md.data[cell].elevation = cd.height = _near_tail_height(rng, array, &md);
+      _require(array_insert(&array, array_bisect(&array, rhgt_lt_bound, &cd), cell));
+    }
+    t1 = _now_ns();
+    for(size_t op = 0; op < count; ++op) {
+      _require(array_delete(&array, array->size - 1));
+    }
+    insert_ns += t1 - t0;
+    pop_ns += _now_ns() - t1;
+  }
+  printf("  %-10ld %-12s %10.1f\n", size, "insert", insert_ns / ops);
+  printf("  %-10ld %-12s %10.1f\n", size, "pop", pop_ns / ops);
+
+  // Decrease-key:  lower a cell that sits a short way above the tail and
+  // move it to its new place, as _safe_update_elev does.
+  t0 = _now_ns();
+  for(size_t op = 0; op < ops; ++op) {
+    size_t reach = array->size < 4096 ? array->size : 4096;
+    size_t aidx = array->size - 1 - rand_below(rng, reach);
+    size_t cell = array->data[aidx];
+    cd.height = md.data[cell].elevation - 64.0 * rand_unit(rng);
+    size_t naidx = array_bisect(&array, rhgt_lt_bound, &cd);
+    array_move_elem(&array, aidx, naidx);
+    md.data[cell].elevation = cd.height;
+  }
+  t1 = _now_ns();
+  printf("  %-10ld %-12s %10.1f\n", size, "move_elem", (t1 - t0) / ops);
+
+  // Bare lookups.
+  t0 = _now_ns();
+  volatile size_t sink = 0;
+  for(size_t op = 0; op < ops; ++op) {
+    cd.height = (double)rand_below(rng, size);
+    sink += array_bisect(&array, rhgt_lt_bound, &cd);
+  }
+  t1 = _now_ns();
+  printf("  %-10ld %-12s %10.1f\n", size, "bisect", (t1 - t0) / ops);
+
+  array_free(&array);
+  free(md.data);
+}
+
+// Append from a tiny initial capacity and record every resize.
+void bench_growth(size_t size) {
+  array_type *array;
+  size_t resizes = 0;
+  size_t capacity;
+  double t0, t1;
+
+  _require(array_init(&array, 16));
+  capacity = array->capacity;
+  t0 = _now_ns();
+  for(size_t idx = 0; idx < size; ++idx) {
+    _require(array_insert(&array, array->size, idx));
+    if(array->capacity != capacity) {
+      capacity = array->capacity;
+      resizes += 1;
+    }
+  }
+  t1 = _now_ns();
+  printf("  %-10ld %-12s %10.1f   %ld resizes, capacity %ld (%.2fx)\n",
+         size, "append", (t1 - t0) / size, resizes, array->capacity,
+         (double)array->capacity / size);
+  array_free(&array);
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t seed = argc > 1 ? strtoull(argv[1], NULL, 0) : 1;
+  size_t max_size = argc > 2 ? strtoull(argv[2], NULL, 0) : 10000000;
+  rand_type rng;
+
+  property_check(seed, 20000);
+
+  printf("\n  %-10s %-12s %10s\n", "size", "op", "ns/op");
+  rand_stream(&rng, seed, 2);
+  for(size_t size = 1000; size <= max_size; size *= 10) {
+    bench_size(&rng, size, 100000);
+  }
+
+  printf("\n");
+  for(size_t size = 1000; size <= max_size; size *= 10) {
+    bench_growth(size);
+  }
+
+  return 0;
+}
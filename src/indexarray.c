@@ -3,6 +3,7 @@
 /// Arrays to hold map indexes.
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -52,7 +53,7 @@ error_type array_insert(array_type **array, size_t idx, size_t value) {
   
   if(ad->size == ad->capacity) {
     size_t new_capacity = ad->capacity ? ad->capacity * 2 : 1;
-    if(NO_ERROR != (err = array_resize(array, new_capacity * 2))) return err;
+    if(NO_ERROR != (err = array_resize(array, new_capacity))) return err;
     ad = *array;
   }
 
@@ -145,6 +146,66 @@ size_t array_bisect(array_type **array, predicate_fn_type pred,
 
 
 
+// A frontier is an unordered bag of map indexes in which each index appears
+// at most once, tracked by a bitmap over the whole map.  It never holds more
+// than 'map_size' entries, so its capacity is capped there.
+error_type frontier_init(frontier_type *frontier, size_t map_size, size_t capacity) {
+  error_type err = NO_ERROR;
+
+  if(capacity > map_size) capacity = map_size;
+  if(capacity == 0) capacity = 1;
+  frontier->map_size = map_size;
+  frontier->peak = 0;
+  frontier->queued = calloc((map_size + 63) / 64, sizeof(uint64_t));
+  if(NULL == frontier->queued) return BUF_ALLOC_ERROR;
+  if(NO_ERROR != (err = array_init(&frontier->cells, capacity))) {
+    free(frontier->queued);
+    return err;
+  }
+  
+  return NO_ERROR;
+}
+
+void frontier_free(frontier_type *frontier) {
+  array_free(&frontier->cells);
+  free(frontier->queued);
+  frontier->queued = NULL;
+}
+
+error_type frontier_push(frontier_type *frontier, size_t idx) {
+  array_type *ad = frontier->cells;
+  uint64_t bit = (uint64_t)1 << (idx % 64);
+  error_type err = NO_ERROR;
+
+  assert(idx < frontier->map_size);
+  if(frontier->queued[idx / 64] & bit) return NO_ERROR;
+
+  if(ad->size == ad->capacity) {
+    size_t new_capacity = ad->capacity * 2;
+    if(new_capacity > frontier->map_size) new_capacity = frontier->map_size;
+    if(NO_ERROR != (err = array_resize(&frontier->cells, new_capacity))) return err;
+    ad = frontier->cells;
+  }
+
+  frontier->queued[idx / 64] |= bit;
+  ad->data[ad->size++] = idx;
+  if(ad->size > frontier->peak) frontier->peak = ad->size;
+
+  return NO_ERROR;
+}
+
+// Remove and return the entry at 'arr_idx'.  The last entry takes its place.
+size_t frontier_take(frontier_type *frontier, size_t arr_idx) {
+  array_type *ad = frontier->cells;
+  
+  assert(arr_idx < ad->size);
+  size_t idx = ad->data[arr_idx];
+  ad->data[arr_idx] = ad->data[--(ad->size)];
+  frontier->queued[idx / 64] &= ~((uint64_t)1 << (idx % 64));
+
+  return idx;
+}
+
 int idx_lt_bound(size_t value, void *data) {
   size_t *idx = data;
   return value < *idx;
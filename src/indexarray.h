@@ -11,6 +11,11 @@ extern size_t     array_move_elem(array_type **array, size_t src_idx, size_t dst
 extern error_type array_delete   (array_type **array, size_t idx);
 extern size_t     array_bisect   (array_type **array, predicate_fn_type pred, void *predData);
 
+extern error_type frontier_init  (frontier_type *frontier, size_t map_size, size_t capacity);
+extern void       frontier_free  (frontier_type *frontier);
+extern error_type frontier_push  (frontier_type *frontier, size_t idx);
+extern size_t     frontier_take  (frontier_type *frontier, size_t arr_idx);
+
 // lt:   Is value less than the curried value?
 // ngt:  Is value not greater than the curried value?
 // idx:  data is a pointer to a size_t
@@ -4,19 +4,28 @@
 
 
 #include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "maptypes.h"
 #include "mapach.h"
+#include "mapdist.h"
+#include "maprand.h"
+#include "mapexport.h"
+#include "mapnuma.h"
+#include "mappool.h"
+#include "mapserve.h"
 
 
 void _minax_elev_xy(double *min, double *max, mapdata_type *md, size_t x, size_t y) {
   size_t idx = mapdata_xy_to_idx(md, x, y);
   double elev = md->data[idx].elevation;
   if(min && !(*min <= elev)) *min=elev;
-  if(max && !(*max <= elev)) *max=elev;
+  if(max && !(*max >= elev)) *max=elev;
 }
 
 void _minax_elev_x(double *min, double *max, mapdata_type *md, size_t x, size_t y0, size_t y1) {
@@ -52,11 +61,85 @@ void _minax_elev(double *min, double *max, mapdata_type *md, size_t x0, size_t x
   } while(y != y1);
 }
 
+typedef struct {
+  mapdata_type    *md;
+  double          min;
+  double          max;
+  pthread_mutex_t lock;
+} _minax_job_type;
+
+void _minax_elev_tile(void *arg, size_t x0, size_t y0, size_t x1, size_t y1) {
+  _minax_job_type *job = arg;
+  double min = NAN, max = NAN;
+  for(size_t y = y0; y < y1; ++y) {
+    _minax_elev_y(&min, &max, job->md, x0, x1 % job->md->dim.x, y);
+  }
+  pthread_mutex_lock(&job->lock);
+  if(!(job->min <= min)) job->min = min;
+  if(!(job->max >= max)) job->max = max;
+  pthread_mutex_unlock(&job->lock);
+}
+
+// _minax_elev over the whole map, one tile per pool task.
+void _minax_elev_all(double *min, double *max, mapdata_type *md) {
+  _minax_job_type job = { md, NAN, NAN, PTHREAD_MUTEX_INITIALIZER };
+  pool_parallel_tiles(_minax_elev_tile, &job, md->dim.x, md->dim.y, 256);
+  *min = job.min;
+  *max = job.max;
+}
+
+void _erode(mapdata_type *md, size_t workers, size_t halo,
+            double river_slope, double max_slope, double omicron) {
+  if(workers) {
+    map_exit_on_error(mapdata_erode_distributed(md, workers, halo,
+                                                river_slope, max_slope, omicron));
+  } else {
+    map_exit_on_error(mapdata_erode(md, river_slope, max_slope, omicron));
+  }
+}
+
+// Write the whole of 'md' to preview.png, through a temporary file so that a
+// viewer watching it never sees half an image.
+void _write_preview(mapdata_type *md, size_t factor) {
+  export_type *ex;
+  double min, max;
+
+  _minax_elev_all(&min, &max, md);
+  map_exit_on_error(mapdata_export_png(&ex, "preview.png.tmp", md,
+                                       0, 0, md->dim.x, md->dim.y,
+                                       min, max - min > 65535 ? max : min + 65535));
+  map_exit_on_error(mapdata_export_wait(&ex));
+  if(rename("preview.png.tmp", "preview.png")) map_exit_on_error(FILE_WRITE_ERROR);
+  if(factor > 1) printf("Preview at 1/%ld scale (%ldx%ld) in preview.png\n", factor, md->dim.x, md->dim.y);
+  else            printf("Full-size map (%ldx%ld) in preview.png\n", md->dim.x, md->dim.y);
+  fflush(stdout);
+}
+
+void _usage(const char *argv0) {
+  printf("Usage:  %s [-x seed] [-t threads] [-p | -N] [-S] [-d workers [-H rows]]\n"
+         "          [-P factor [-R]] [-s socket]\n"
+         "  -x seed     Generate from this seed, as printed by an earlier run\n"
+         "              (default: the time)\n"
+         "  -t threads  Threads in all, this one included (default: one per CPU)\n"
+         "  -p          Pin worker threads to CPUs\n"
+         "  -N          Pin by NUMA node and keep each thread on its own rows\n"
+         "  -S          Also write a hillshade and a normal map with each heightmap\n"
+         "  -d workers  Erode in this many worker processes\n"
+         "  -H rows     Halo rows per worker (default: the widest stencil)\n"
+         "  -P factor   Only write preview.png, generated at 1/factor scale\n"
+         "  -R          Refine preview.png from 1/factor (default 8) scale, halving\n"
+         "              the factor each time, then make the full-size map and\n"
+         "              write it there last\n"
+         "  -s socket   Serve generation requests on this UNIX socket\n", argv0);
+}
 
 int main(int argc, char* argv[]) {
-  char statebuf[256];
-  struct random_data rbuf;
+  rand_type rng;
+  uint64_t seed = time(NULL);
   mapdata_type *mdr, *md;
+  export_type *precopy_ex, *sample_ex;
+  error_type err;
+  size_t frontier_peak;
   const size_t picdim = 1081 * 1.5;
   const size_t dimmul = 2;
   const size_t dimx = dimmul * picdim, dimy = dimmul * picdim;
@@ -71,60 +154,142 @@ int main(int argc, char* argv[]) {
   const double omicron = 2;
   
   //const size_t dimx = 18000, dimy = dimx;
+
+  size_t threads = 0;
+  size_t workers = 0, halo = 0;
+  size_t preview = 1;
+  int refine = 0;
+  const char *socket_path = NULL;
+  pool_placement_type placement = POOL_FLOAT;
+  numa_counters_type numa0, numa1;
+  int shaded = 0;
+  int opt;
+  while(-1 != (opt = getopt(argc, argv, "x:t:pNSd:H:P:Rs:"))) {
+    switch(opt) {
+    case 'x':  seed = strtoull(optarg, NULL, 0);    break;
+    case 't':  threads = strtoul(optarg, NULL, 0);  break;
+    case 'p':  placement = POOL_PIN;                break;
+    case 'N':  placement = POOL_NUMA;               break;
+    case 'S':  shaded = 1;                          break;
+    case 'd':  workers = strtoul(optarg, NULL, 0);  break;
+    case 'H':  halo = strtoul(optarg, NULL, 0);     break;
+    case 'P':  preview = strtoul(optarg, NULL, 0);  break;
+    case 'R':  refine = 1;                          break;
+    case 's':  socket_path = optarg;                break;
+    default:
+      _usage(argv[0]);
+      return(1);
+    }
+  }
+  if(refine && preview == 1) preview = 8;
+  if(preview == 0 || dimx / preview < 16 || dimy / preview < 16) {
+    _usage(argv[0]);
+    return(1);
+  }
+  map_exit_on_error(pool_start(threads, placement));
+  printf("Threads:  %ld%s\n", pool_threads(),
+         placement == POOL_NUMA ? " (NUMA banded)" : placement == POOL_PIN ? " (pinned)" : "");
+  mapnuma_counters(&numa0);
+  if(socket_path) {
+    map_exit_on_error(mapach_serve(socket_path));
+    pool_stop();
+    return(0);
+  }
   
-  rbuf.state = NULL;
-  initstate_r(time(NULL), statebuf, 256, &rbuf);
+  printf("Seed:  %lu\n", (unsigned long)seed);
+  rand_seed(&rng, seed);
+
+  // A map 'factor' times coarser keeps the same grades on the ground with
+  // its slopes per cell scaled up by as much.  Each of its cells gathers the
+  // rain of factor^2 cells, which carries about the same flow down its
+  // rivers.  Eroded from there it comes out too shallow next to the
+  // full-size map shrunk by mapdata_copy;  another sqrt(factor) on the water
+  // fits that best, across factors 2 to 8.
+  if(preview > 1 && !refine) {
+    printf("Preview generation...\n");
+    map_exit_on_error(mapdata_init(&mdr, dimx / preview, dimy / preview));
+    map_exit_on_error(mapdata_rough_gen(mdr, &rng, gen_slope * preview,
+                                        rainwater * preview * preview * sqrt(preview),
+                                        NULL));
+    _erode(mdr, workers, halo, gen_slope * preview, max_slope * preview, omicron);
+    _write_preview(mdr, preview);
+    mapdata_free(&mdr);
+    pool_stop();
+    return(0);
+  }
 
   printf("Initializing map data...\n");
   map_exit_on_error(mapdata_init(&mdr, dimx, dimy));
   map_exit_on_error(mapdata_init(&md, picdim, picdim));
 
   printf("Map generation...\n");
-  map_exit_on_error(mapdata_rough_gen(mdr, &rbuf, gen_slope, rainwater));
+  map_exit_on_error(mapdata_rough_gen(mdr, &rng, gen_slope, rainwater, &frontier_peak));
+  printf("Frontier peak:  %ld cells\n", frontier_peak);
+
+  // Refined previews are shrunk from the full-size rough map rather than
+  // generated afresh, so each is a coarser view of the final map, which
+  // replaces them once eroded.  Each level erodes from its own rough map:
+  // erosion visits every cell whatever height it starts at, so starting from
+  // the coarser eroded level would change the result without saving work.
+  for(size_t factor = refine ? preview : 1; factor > 1; factor /= 2) {
+    mapdata_type *mdp;
+    printf("Preview erosion at 1/%ld scale...\n", factor);
+    map_exit_on_error(mapdata_init(&mdp, dimx / factor, dimy / factor));
+    map_exit_on_error(mapdata_shrink(mdr, mdp, sqrt(factor)));
+    _erode(mdp, workers, halo, gen_slope * factor, max_slope * factor, omicron);
+    _write_preview(mdp, factor);
+    mapdata_free(&mdp);
+  }
 
   printf("Map erosion...\n");
-  map_exit_on_error(mapdata_erode(mdr, gen_slope, max_slope, omicron));
+  _erode(mdr, workers, halo, gen_slope, max_slope, omicron);
+  if(refine) _write_preview(mdr, 1);
 
   {
-    FILE *fp = fopen("precopy.png", "wb");
-    if(fp) {
-      double rmin=NAN, rmax=NAN; _minax_elev(&rmin, &rmax, mdr, 0, 0, 0, 0);
-      double scale_elev = rmax - rmin > 65535 ? rmax : rmin + 65535;
-      mapdata_write_png(fp, mdr, 0, 0, mdr->dim.x, mdr->dim.y, rmin, scale_elev);
-      fclose(fp);
-    }
+    double rmin, rmax; _minax_elev_all(&rmin, &rmax, mdr);
+    double scale_elev = rmax - rmin > 65535 ? rmax : rmin + 65535;
+    map_exit_on_error(mapdata_export_maps(&precopy_ex, "precopy.png",
+                                          shaded ? "precopy-shade.png" : NULL,
+                                          shaded ? "precopy-normal.png" : NULL,
+                                          mdr, 0, 0, mdr->dim.x, mdr->dim.y,
+                                          rmin, scale_elev, pixelres / pixelheight));
   }
 
   printf("Map implosion...\n");
-  mapdata_copy(mdr, md);
+  map_exit_on_error(mapdata_copy(mdr, md));
 
   mapdata_free(&mdr);
   
   printf("\nELEVATION:\n");
   double min_elev = md->data[0].elevation;
   double max_elev = min_elev;
-  for(size_t idx = 0; idx < md->size; ++idx) {
-    double elev = md->data[idx].elevation;
-    char isZenith = 1;
-    char isNadir = 1;
-    for(size_t sidx = 0; sidx < 8; sidx += 2) {
-      size_t eidx = mapdata_surround(md, idx, sidx);
-      double eElev = md->data[eidx].elevation;
-      if(eElev > elev) isZenith = 0;
-      else if(eElev < elev) isNadir = 0;
-    }
+  for(size_t y = 0; y < md->dim.y; ++y) {
+    const datum_type *row = md->data + mapdata_xy_to_idx(md, 0, y);
+    const datum_type *up = md->data + mapdata_xy_to_idx(md, 0, (y + md->dim.y - 1) % md->dim.y);
+    const datum_type *down = md->data + mapdata_xy_to_idx(md, 0, (y + 1) % md->dim.y);
+    for(size_t x = 0; x < md->dim.x; ++x) {
+      size_t west = x ? x - 1 : md->dim.x - 1;
+      size_t east = x + 1 < md->dim.x ? x + 1 : 0;
+      double elev = row[x].elevation;
+      double around[4] = { up[x].elevation, row[east].elevation,
+                           down[x].elevation, row[west].elevation };
+      char isZenith = 1;
+      char isNadir = 1;
+      for(size_t sidx = 0; sidx < 4; ++sidx) {
+        if(around[sidx] > elev) isZenith = 0;
+        else if(around[sidx] < elev) isNadir = 0;
+      }
     
-    if(elev < min_elev) {
-      min_elev = elev;
-    } else if (elev > max_elev) {
-      max_elev = elev;
-    }
+      if(elev < min_elev) {
+        min_elev = elev;
+      } else if (elev > max_elev) {
+        max_elev = elev;
+      }
 
-    if(isNadir || isZenith) {
-      coord_type xy = mapdata_idx_to_coord(md, idx);
-      printf("%c%c %5ld,%-5ld %03g\n", isNadir ? 'N' : ' ',
-             isZenith ? 'Z' : ' ', xy.x, xy.y,
-             md->data[idx].elevation);
+      if(isNadir || isZenith) {
+        printf("%c%c %5ld,%-5ld %03g\n", isNadir ? 'N' : ' ',
+               isZenith ? 'Z' : ' ', x, y, elev);
+      }
     }
   }
 
@@ -169,13 +334,32 @@ int main(int argc, char* argv[]) {
 
   {
     double scale_elev = max_elev - special_min > 65535 ? max_elev : special_min + 65535;
-    FILE *fp = fopen("sample.png", "wb");
-    if(fp) {
-      size_t xb = (md->dim.x - 1081) / 2;
-      size_t yb = (md->dim.y - 1081) / 2;
-      mapdata_write_png(fp, md, xb, yb, xb + 1081, yb + 1081, special_min, scale_elev);
-      fclose(fp);
-    }
+    size_t xb = (md->dim.x - 1081) / 2;
+    size_t yb = (md->dim.y - 1081) / 2;
+    map_exit_on_error(mapdata_export_maps(&sample_ex, "sample.png",
+                                          shaded ? "sample-shade.png" : NULL,
+                                          shaded ? "sample-normal.png" : NULL,
+                                          md, xb, yb, xb + 1081, yb + 1081,
+                                          special_min, scale_elev,
+                                          dimmul * pixelres / pixelheight));
+  }
+
+  mapdata_free(&md);
+  
+  printf("Waiting on output...\n");
+  if(NO_ERROR != (err = mapdata_export_wait(&precopy_ex))) map_perror(err);
+  if(NO_ERROR != (err = mapdata_export_wait(&sample_ex)))  map_perror(err);
+  pool_stop();
+
+  // The kernel keeps these per node, not per process:  whatever else ran on
+  // the host meanwhile is counted too.
+  if(NO_ERROR == mapnuma_counters(&numa1) && numa1.nodes) {
+    printf("NUMA:  %ld node(s).  Page allocations by every process on the host "
+           "during the run, not this one alone:\n"
+           "       %llu local, %llu other-node, %llu missed\n", numa1.nodes,
+           (unsigned long long)(numa1.local_node - numa0.local_node),
+           (unsigned long long)(numa1.other_node - numa0.other_node),
+           (unsigned long long)(numa1.miss - numa0.miss));
   }
   
   printf("Exiting...\n");
@@ -6,9 +6,15 @@ extern void        map_perror(error_type e);
 extern void        map_exit_on_error(error_type e);
 
 extern error_type mapdata_init(mapdata_type **mdh, size_t dim_x, size_t dim_y);
+extern void       mapdata_reset(mapdata_type *md);
 extern void       mapdata_free(mapdata_type **mdh);
 
-extern void       mapdata_copy(mapdata_type *mdsrc, mapdata_type *mddst);
+extern error_type mapdata_copy(mapdata_type *mdsrc, mapdata_type *mddst);
+extern error_type mapdata_shrink(mapdata_type *mdsrc, mapdata_type *mddst,
+                                 double water_scale);
+extern error_type mapdata_mip_chain(mapdata_type *md, mip_level_type *levels,
+                                    size_t count);
+extern void       mip_chain_free(mip_level_type *levels, size_t count);
 
 extern size_t     mapdata_coord_to_idx(mapdata_type *md, coord_type coord);
 extern size_t     mapdata_xy_to_idx(mapdata_type *md, size_t x, size_t y);
@@ -16,14 +22,58 @@ extern coord_type mapdata_idx_to_coord(mapdata_type *md, size_t idx);
 
 extern size_t     mapdata_surround(mapdata_type *md, size_t center, direction_type d);
 
-extern error_type mapdata_rough_gen(mapdata_type *md, struct random_data *rbuf,
-                                    double max_slope, double rainwater);
+extern error_type mapdata_rough_gen(mapdata_type *md, rand_type *rng,
+                                    double max_slope, double rainwater,
+                                    size_t *frontier_peak);
 
 extern error_type mapdata_erode(mapdata_type *md, double river_slope,
                                 double max_slope, double omicron);
 
+extern size_t     mapdata_erode_span_max(mapdata_type *md, double river_slope,
+                                         double omicron);
+
+extern error_type mapdata_erode_band(mapdata_type *md, transport_type *tp,
+                                     size_t y0, size_t map_dim_y,
+                                     size_t halo, size_t hspan_max,
+                                     double river_slope, double max_slope,
+                                     double omicron);
+
+extern void       mapdata_mark_dirty(mapdata_type *md,
+                                     size_t x0, size_t y0, size_t x1, size_t y1);
+extern void       mapdata_mark_dirty_idx(mapdata_type *md, size_t idx);
+extern error_type mapdata_erode_dirty(mapdata_type *md, double river_slope,
+                                      double max_slope, double omicron);
+
 extern error_type mapdata_write_png(FILE *fp, mapdata_type *md,
                                     size_t x0, size_t y0,
                                     size_t x1, size_t y1,
                                     double black_elev, double white_elev);
 
+extern error_type mapdata_write_raw(FILE *fp, mapdata_type *md,
+                                    size_t x0, size_t y0,
+                                    size_t x1, size_t y1,
+                                    double black_elev, double white_elev,
+                                    raw_format_type fmt);
+
+extern void       mapdata_quantize(mapdata_type *md,
+                                   size_t x0, size_t y0,
+                                   size_t x1, size_t y1,
+                                   double black_elev, double white_elev,
+                                   unsigned short *samples);
+extern void       elevation_quantize(const double *elevation,
+                                     size_t width, size_t height,
+                                     double black_elev, double white_elev,
+                                     unsigned short *samples);
+extern error_type mapdata_shade(mapdata_type *md,
+                                size_t x0, size_t y0,
+                                size_t x1, size_t y1,
+                                double black_elev, double white_elev,
+                                double cell_size,
+                                unsigned short *heights, unsigned char *shade,
+                                unsigned char *normals);
+extern error_type gray16_write_png(FILE *fp, size_t width, size_t height,
+                                   const unsigned short *samples);
+extern error_type gray8_write_png(FILE *fp, size_t width, size_t height,
+                                  const unsigned char *samples);
+extern error_type rgb8_write_png(FILE *fp, size_t width, size_t height,
+                                 const unsigned char *samples);
@@ -0,0 +1,215 @@
+/// @file:  mapdist.c
+///
+/// Distributed erosion across worker processes.
+///
+/// The coordinator cuts the toroidal map into bands of whole rows and forks
+/// one worker per band.  Each worker keeps a private copy of its band plus a
+/// halo of rows on either side and erodes it with mapdata_erode_band, which
+/// only ever lowers the rows the worker owns.  Between rounds the workers
+/// publish their own rows and pick up their neighbors' edges through a
+/// transport_type; here that is a POSIX shared-memory plane of the map's
+/// elevations, guarded by a process-shared barrier.  Water, which erosion
+/// never changes, is read from the coordinator's map each forked worker
+/// inherits.  Since every worker only talks to the transport, one that
+/// carries rows over sockets could put the workers on other hosts without
+/// changing them.
+///
+/// With a halo as deep as the widest stencil on the map the result is
+/// exactly what mapdata_erode computes, and that is the default.  A
+/// shallower halo caps the stencil, trading accuracy along the widest rivers
+/// for memory and traffic.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "maptypes.h"
+#include "mapach.h"
+#include "mapdist.h"
+
+#define DIST_MAX_WORKERS 256
+
+typedef struct {
+  pthread_barrier_t barrier;
+  size_t            dim_x;
+  size_t            workers;
+  size_t            values[2][DIST_MAX_WORKERS];
+} _shm_header_type;
+
+typedef struct {
+  _shm_header_type *header;
+  double           *plane;
+  const datum_type *source;    // The coordinator's map, as of the fork
+  size_t           worker;
+  size_t           reductions;
+} _shm_state_type;
+
+error_type _shm_put_rows(transport_type *tp, size_t y, const datum_type *rows, size_t count) {
+  _shm_state_type *st = tp->state;
+  size_t dim_x = st->header->dim_x;
+  double *dst = st->plane + y * dim_x;
+
+  for(size_t i = 0; i < count * dim_x; ++i) {
+    dst[i] = rows[i].elevation;
+  }
+  return NO_ERROR;
+}
+
+error_type _shm_get_rows(transport_type *tp, size_t y, datum_type *rows, size_t count) {
+  _shm_state_type *st = tp->state;
+  size_t dim_x = st->header->dim_x;
+  const double *src = st->plane + y * dim_x;
+  const datum_type *source = st->source + y * dim_x;
+
+  for(size_t i = 0; i < count * dim_x; ++i) {
+    rows[i].elevation = src[i];
+    rows[i].water = source[i].water;
+    rows[i].group = 0;
+  }
+  return NO_ERROR;
+}
+
+error_type _shm_barrier(transport_type *tp) {
+  _shm_state_type *st = tp->state;
+  int r = pthread_barrier_wait(&st->header->barrier);
+  return r == 0 || r == PTHREAD_BARRIER_SERIAL_THREAD ? NO_ERROR : PROCESS_ERROR;
+}
+
+// Reductions alternate between two slots, so a fast worker's next value
+// cannot land before a slow one has read this round's.
+error_type _shm_reduce(transport_type *tp, size_t value, size_t *total) {
+  _shm_state_type *st = tp->state;
+  _shm_header_type *header = st->header;
+  size_t *slot = header->values[st->reductions++ & 1];
+  error_type e;
+
+  slot[st->worker] = value;
+  if(NO_ERROR != (e = _shm_barrier(tp))) return e;
+  *total = 0;
+  for(size_t w = 0; w < header->workers; ++w) *total += slot[w];
+  return NO_ERROR;
+}
+
+// Run in the forked worker:  erode rows [y0, y1) and report through the
+// exit status.
+int _dist_worker(_shm_header_type *header, double *plane, const datum_type *source,
+                 size_t worker, size_t y0, size_t y1, size_t dim_y, size_t halo,
+                 double river_slope, double max_slope, double omicron) {
+  _shm_state_type st = { header, plane, source, worker, 0 };
+  transport_type tp = { _shm_put_rows, _shm_get_rows, _shm_reduce, _shm_barrier, &st };
+  mapdata_type *band;
+  error_type e;
+
+  if(NO_ERROR != (e = mapdata_init(&band, header->dim_x, y1 - y0 + 2 * halo))) return e;
+  e = mapdata_erode_band(band, &tp, y0, dim_y, halo, halo,
+                         river_slope, max_slope, omicron);
+  mapdata_free(&band);
+  return e;
+}
+
+// Erode 'md' with 'workers' processes, each holding 'halo' rows of context
+// on either side of its band (0 for as many as the widest stencil on this
+// map needs, which is also the most that is ever used).
+error_type mapdata_erode_distributed(mapdata_type *md, size_t workers, size_t halo,
+                                     double river_slope, double max_slope,
+                                     double omicron) {
+  static unsigned long serial = 0;
+  size_t span = mapdata_erode_span_max(md, river_slope, omicron);
+  size_t bytes = sizeof(_shm_header_type) + md->size * sizeof(double);
+  pid_t pids[DIST_MAX_WORKERS];
+  size_t started = 0;
+  _shm_header_type *header;
+  double *plane;
+  pthread_barrierattr_t attr;
+  error_type e = NO_ERROR;
+  char name[64];
+  int fd;
+
+  if(halo == 0 || halo > span) halo = span;
+  if(workers > DIST_MAX_WORKERS) workers = DIST_MAX_WORKERS;
+  if(workers > md->dim.y) workers = md->dim.y;
+  if(workers == 0) workers = 1;
+
+  snprintf(name, sizeof(name), "/mapach-%ld-%lu", (long)getpid(), serial++);
+  if(-1 == (fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600))) return BUF_ALLOC_ERROR;
+  if(ftruncate(fd, bytes) ||
+     MAP_FAILED == (header = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0))) {
+    close(fd);
+    shm_unlink(name);
+    return BUF_ALLOC_ERROR;
+  }
+  close(fd);
+  plane = (double *)(header + 1);
+
+  header->dim_x = md->dim.x;
+  header->workers = workers;
+  pthread_barrierattr_init(&attr);
+  pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_barrier_init(&header->barrier, &attr, workers);
+  pthread_barrierattr_destroy(&attr);
+  for(size_t idx = 0; idx < md->size; ++idx) plane[idx] = md->data[idx].elevation;
+
+  for(; started < workers; ++started) {
+    size_t y0 = started * md->dim.y / workers;
+    size_t y1 = (started + 1) * md->dim.y / workers;
+    pids[started] = fork();
+    if(pids[started] == 0) {
+      int status = _dist_worker(header, plane, md->data, started, y0, y1, md->dim.y,
+                                halo, river_slope, max_slope, omicron);
+      _exit(status);
+    }
+    if(pids[started] < 0) {
+      e = PROCESS_ERROR;
+      break;
+    }
+  }
+
+  // A worker that dies leaves the rest stuck at the barrier, so take the
+  // others down with it.  Only our own workers are reaped, whichever exits
+  // first:  the caller may have children of its own.
+  for(size_t live = started; live; ) {
+    const struct timespec pause = { 0, 1000000 };
+    size_t reaped = 0;
+    
+    if(NO_ERROR != e) {
+      for(size_t w = 0; w < started; ++w) {
+        if(pids[w] > 0) kill(pids[w], SIGKILL);
+      }
+    }
+    for(size_t w = 0; w < started; ++w) {
+      int status;
+      pid_t pid;
+
+      if(pids[w] <= 0) continue;
+      if(0 == (pid = waitpid(pids[w], &status, WNOHANG))) continue;
+      if(pid < 0 && errno == EINTR) continue;
+      pids[w] = 0;
+      reaped += 1;
+      if(pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) e = PROCESS_ERROR;
+    }
+    live -= reaped;
+    if(live && !reaped) nanosleep(&pause, NULL);
+  }
+
+  if(NO_ERROR == e) {
+    for(size_t idx = 0; idx < md->size; ++idx) {
+      md->data[idx].elevation = plane[idx];
+      md->data[idx].group = ERODE_DONE;
+    }
+    md->dirty0.x = md->dirty0.y = md->dirty_len.x = md->dirty_len.y = 0;
+  }
+
+  pthread_barrier_destroy(&header->barrier);
+  munmap(header, bytes);
+  shm_unlink(name);
+  return e;
+}
@@ -0,0 +1,7 @@
+/// @file:  mapdist.h
+///
+/// Distributed erosion declarations
+
+extern error_type mapdata_erode_distributed(mapdata_type *md, size_t workers, size_t halo,
+                                            double river_slope, double max_slope,
+                                            double omicron);
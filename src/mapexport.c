@@ -0,0 +1,270 @@
+/// @file:  mapexport.c
+///
+/// Background map export.  The requested window is quantized into a private
+/// snapshot before the export call returns, which is cheap, and the PNG
+/// encoding, which is not, runs as a task on the shared pool.  The caller may
+/// keep modifying or even free the map as soon as the export call returns.
+/// The hillshade and normal map are shaded in the same pass over the map as
+/// the heightmap snapshot and encoded by the same task.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "maptypes.h"
+#include "mapach.h"
+#include "mapexport.h"
+#include "mappool.h"
+
+struct export_struct {
+  task_type      *task;
+  char           *path;
+  char           *shade_path;
+  char           *normal_path;
+  size_t         width;
+  size_t         height;
+  size_t         bytes;
+  unsigned short *samples;
+  unsigned char  *shade;
+  unsigned char  *normals;
+  error_type     result;
+};
+
+static pthread_mutex_t _export_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  _export_drained = PTHREAD_COND_INITIALIZER;
+static size_t          _export_in_flight = 0;
+static size_t          _export_cap = 256 << 20;
+
+// Cap the snapshot memory held by unfinished exports.  A single export larger
+// than the cap is still allowed once nothing else is in flight.  A caller
+// held back by the cap runs pool tasks, which may be the writers it waits on.
+void mapdata_export_limit(size_t bytes) {
+  pthread_mutex_lock(&_export_lock);
+  _export_cap = bytes;
+  pthread_cond_broadcast(&_export_drained);
+  pthread_mutex_unlock(&_export_lock);
+}
+
+void _export_reserve(size_t bytes) {
+  pthread_mutex_lock(&_export_lock);
+  while(_export_in_flight && _export_in_flight + bytes > _export_cap) {
+    pthread_mutex_unlock(&_export_lock);
+    int ran = pool_run_one();
+    pthread_mutex_lock(&_export_lock);
+    if(!ran && _export_in_flight && _export_in_flight + bytes > _export_cap) {
+      pthread_cond_wait(&_export_drained, &_export_lock);
+    }
+  }
+  _export_in_flight += bytes;
+  pthread_mutex_unlock(&_export_lock);
+}
+
+void _export_release(size_t bytes) {
+  pthread_mutex_lock(&_export_lock);
+  _export_in_flight -= bytes;
+  pthread_cond_broadcast(&_export_drained);
+  pthread_mutex_unlock(&_export_lock);
+}
+
+// Write one of the export's images, keeping the first error.
+void _export_write(export_type *ex, const char *path, size_t channels,
+                   const void *samples) {
+  FILE *fp;
+  error_type e;
+
+  if(NULL == path) return;
+  if(NULL == (fp = fopen(path, "wb"))) {
+    e = FILE_OPEN_ERROR;
+  } else {
+    switch(channels) {
+    case 1:  e = gray8_write_png(fp, ex->width, ex->height, samples);   break;
+    case 3:  e = rgb8_write_png(fp, ex->width, ex->height, samples);    break;
+    default: e = gray16_write_png(fp, ex->width, ex->height, samples);  break;
+    }
+    fclose(fp);
+  }
+  if(NO_ERROR == ex->result) ex->result = e;
+}
+
+void _export_run(void *arg) {
+  export_type *ex = arg;
+
+  _export_write(ex, ex->path, 0, ex->samples);
+  _export_write(ex, ex->shade_path, 1, ex->shade);
+  _export_write(ex, ex->normal_path, 3, ex->normals);
+
+  free(ex->samples);
+  free(ex->shade);
+  free(ex->normals);
+  ex->samples = NULL;
+  ex->shade = ex->normals = NULL;
+  _export_release(ex->bytes);
+}
+
+void _export_free(export_type *ex) {
+  free(ex->path);
+  free(ex->shade_path);
+  free(ex->normal_path);
+  free(ex->samples);
+  free(ex->shade);
+  free(ex->normals);
+  free(ex);
+}
+
+char *_export_strdup(const char *path, int *failed) {
+  char *copy;
+
+  if(NULL == path) return NULL;
+  if(NULL == (copy = malloc(strlen(path) + 1))) *failed = 1;
+  else strcpy(copy, path);
+  return copy;
+}
+
+// Hand a filled-in export to the pool to encode.
+error_type _export_submit(export_type **exh, export_type *ex) {
+  if(NO_ERROR != pool_task(&ex->task, _export_run, ex)) {
+    _export_release(ex->bytes);
+    _export_free(ex);
+    return BUF_ALLOC_ERROR;
+  }
+  pool_submit(ex->task);
+
+  *exh = ex;
+  return NO_ERROR;
+}
+
+error_type mapdata_export_png(export_type **exh, const char *path,
+                              mapdata_type *md,
+                              size_t x0, size_t y0,
+                              size_t x1, size_t y1,
+                              double black_elev, double white_elev) {
+  return mapdata_export_maps(exh, path, NULL, NULL, md, x0, y0, x1, y1,
+                             black_elev, white_elev, 1);
+}
+
+// Export any of the window's heightmap (16-bit gray), hillshade (8-bit gray)
+// and normal map (8-bit RGB) under one handle; NULL paths are skipped.
+// 'cell_size' is the width of a cell in elevation units.
+error_type mapdata_export_maps(export_type **exh, const char *height_path,
+                               const char *shade_path, const char *normal_path,
+                               mapdata_type *md,
+                               size_t x0, size_t y0,
+                               size_t x1, size_t y1,
+                               double black_elev, double white_elev,
+                               double cell_size) {
+  export_type *ex = (export_type *) calloc(1, sizeof(export_type));
+  size_t cells = (x1 - x0) * (y1 - y0);
+  int failed = 0;
+
+  if(NULL == ex) return BUF_ALLOC_ERROR;
+
+  ex->width = x1 - x0;
+  ex->height = y1 - y0;
+  ex->bytes = (height_path ? cells * sizeof(unsigned short) : 0)
+            + (shade_path ? cells : 0) + (normal_path ? 3 * cells : 0);
+
+  _export_reserve(ex->bytes);
+  
+  ex->path = _export_strdup(height_path, &failed);
+  ex->shade_path = _export_strdup(shade_path, &failed);
+  ex->normal_path = _export_strdup(normal_path, &failed);
+  if(height_path && NULL == (ex->samples = malloc(cells * sizeof(unsigned short)))) failed = 1;
+  if(shade_path && NULL == (ex->shade = malloc(cells))) failed = 1;
+  if(normal_path && NULL == (ex->normals = malloc(3 * cells))) failed = 1;
+  if(failed ||
+     NO_ERROR != mapdata_shade(md, x0, y0, x1, y1, black_elev, white_elev, cell_size,
+                               ex->samples, ex->shade, ex->normals)) {
+    _export_release(ex->bytes);
+    _export_free(ex);
+    return BUF_ALLOC_ERROR;
+  }
+  return _export_submit(exh, ex);
+}
+
+// Export a bare elevation plane, such as a mip level, as a 16-bit heightmap.
+error_type elevation_export_png(export_type **exh, const char *path,
+                                const double *elevation,
+                                size_t width, size_t height,
+                                double black_elev, double white_elev) {
+  export_type *ex = (export_type *) calloc(1, sizeof(export_type));
+  int failed = 0;
+
+  if(NULL == ex) return BUF_ALLOC_ERROR;
+
+  ex->width = width;
+  ex->height = height;
+  ex->bytes = width * height * sizeof(unsigned short);
+
+  _export_reserve(ex->bytes);
+  
+  ex->path = _export_strdup(path, &failed);
+  if(failed || NULL == (ex->samples = malloc(ex->bytes))) {
+    _export_release(ex->bytes);
+    _export_free(ex);
+    return BUF_ALLOC_ERROR;
+  }
+  elevation_quantize(elevation, width, height, black_elev, white_elev, ex->samples);
+  return _export_submit(exh, ex);
+}
+
+// Block until the export is written, release the handle, and return the
+// writer's result.
+error_type mapdata_export_wait(export_type **exh) {
+  export_type *ex = *exh;
+  error_type e;
+
+  pool_wait(&ex->task);
+  e = ex->result;
+  _export_free(ex);
+  *exh = NULL;
+  
+  return e;
+}
+
+// Export 'md' and 'count' halved levels below it as '<prefix><level>.png',
+// level 0 being 'md' itself.  The levels are built in one pass by
+// mapdata_mip_chain and encoded concurrently.
+error_type mapdata_export_mip_chain(const char *prefix, mapdata_type *md,
+                                    size_t count,
+                                    double black_elev, double white_elev) {
+  mip_level_type *levels = calloc(count + 1, sizeof(mip_level_type));
+  export_type **exports = calloc(count + 1, sizeof(export_type *));
+  size_t path_size = strlen(prefix) + sizeof("18446744073709551615.png");
+  char *path = malloc(path_size);
+  error_type e = NO_ERROR;
+
+  if(NULL == levels || NULL == exports || NULL == path) {
+    free(levels);
+    free(exports);
+    free(path);
+    return BUF_ALLOC_ERROR;
+  }
+
+  if(NO_ERROR == (e = mapdata_mip_chain(md, levels + 1, count))) {
+    for(size_t level = 0; level <= count && NO_ERROR == e; ++level) {
+      snprintf(path, path_size, "%s%lu.png", prefix, level);
+      if(level == 0) {
+        e = mapdata_export_png(exports, path, md, 0, 0, md->dim.x, md->dim.y,
+                               black_elev, white_elev);
+      } else {
+        e = elevation_export_png(exports + level, path, levels[level].elevation,
+                                 levels[level].dim.x, levels[level].dim.y,
+                                 black_elev, white_elev);
+      }
+    }
+    mip_chain_free(levels + 1, count);
+    for(size_t level = 0; level <= count; ++level) {
+      if(exports[level]) {
+        error_type we = mapdata_export_wait(exports + level);
+        if(NO_ERROR == e) e = we;
+      }
+    }
+  }
+
+  free(levels);
+  free(exports);
+  free(path);
+  return e;
+}
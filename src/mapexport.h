@@ -0,0 +1,25 @@
+/// @file:  mapexport.h
+///
+/// Background map export declarations
+
+extern void       mapdata_export_limit(size_t bytes);
+extern error_type mapdata_export_png(export_type **exh, const char *path,
+                                     mapdata_type *md,
+                                     size_t x0, size_t y0,
+                                     size_t x1, size_t y1,
+                                     double black_elev, double white_elev);
+extern error_type mapdata_export_maps(export_type **exh, const char *height_path,
+                                      const char *shade_path, const char *normal_path,
+                                      mapdata_type *md,
+                                      size_t x0, size_t y0,
+                                      size_t x1, size_t y1,
+                                      double black_elev, double white_elev,
+                                      double cell_size);
+extern error_type elevation_export_png(export_type **exh, const char *path,
+                                       const double *elevation,
+                                       size_t width, size_t height,
+                                       double black_elev, double white_elev);
+extern error_type mapdata_export_wait(export_type **exh);
+extern error_type mapdata_export_mip_chain(const char *prefix, mapdata_type *md,
+                                          size_t count,
+                                          double black_elev, double white_elev);
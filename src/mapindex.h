@@ -0,0 +1,46 @@
+/// @file:  mapindex.h
+///
+/// Inline map indexing.
+///
+/// Each function takes a 'pow2' flag, which must be md->pow2.  Hot loops
+/// are written as always-inline bodies taking the flag and entered through
+/// a dispatcher that passes a literal 1 or 0, so each loop is compiled
+/// twice:  once with shifts and masks for power-of-two maps, and once with
+/// division by multiplication against the reciprocals set up in mapdata_init.
+
+#define MD_INLINE static inline __attribute__((always_inline))
+
+// v / dim.x
+MD_INLINE size_t md_div_x(const mapdata_type *md, size_t v, int pow2) {
+  if(pow2)          return v >> md->shift_x;
+  if(md->recip_x)   return (size_t)(((unsigned __int128)v * md->recip_x) >> 64);
+  return v / md->dim.x;
+}
+
+MD_INLINE size_t md_xy_to_idx(const mapdata_type *md, size_t x, size_t y, int pow2) {
+  if(pow2) return (y << md->shift_x) | x;
+  return y * md->dim.x + x;
+}
+
+MD_INLINE coord_type md_idx_to_coord(const mapdata_type *md, size_t idx, int pow2) {
+  coord_type result;
+  result.y = md_div_x(md, idx, pow2);
+  result.x = pow2 ? idx & md->mask_x : idx - result.y * md->dim.x;
+  return result;
+}
+
+MD_INLINE size_t md_surround(const mapdata_type *md, size_t center,
+                             direction_type d, int pow2) {
+  if(pow2) {
+    size_t x = (center + md->dir_offset[d].x) & md->mask_x;
+    size_t y = ((center >> md->shift_x) + md->dir_offset[d].y) & md->mask_y;
+    return (y << md->shift_x) | x;
+  } else {
+    coord_type c = md_idx_to_coord(md, center, 0);
+    size_t x = c.x + md->dir_offset[d].x;
+    size_t y = c.y + md->dir_offset[d].y;
+    if(x >= md->dim.x) x -= md->dim.x;
+    if(y >= md->dim.y) y -= md->dim.y;
+    return y * md->dim.x + x;
+  }
+}
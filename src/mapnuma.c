@@ -0,0 +1,99 @@
+/// @file:  mapnuma.c
+///
+/// NUMA topology and counters, read from sysfs rather than through libnuma,
+/// so that machines without it (or with a single node) need nothing extra.
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "maptypes.h"
+#include "mapnuma.h"
+
+#define NUMA_SYSFS     "/sys/devices/system/node"
+#define NUMA_MAX_NODES 1024
+
+// Parse a kernel list such as "0-3,8,10-11" from 'path' into 'set'.  Returns
+// 0 if the file could not be read.
+int _numa_read_list(const char *path, cpu_set_t *set) {
+  FILE *fp = fopen(path, "r");
+  char buf[4096];
+  char *p;
+
+  CPU_ZERO(set);
+  if(NULL == fp) return 0;
+  p = fgets(buf, sizeof(buf), fp);
+  fclose(fp);
+  if(NULL == p) return 0;
+
+  while(*p && *p != '\n') {
+    char *end;
+    long lo = strtol(p, &end, 10), hi = lo;
+    if(end == p) return 0;
+    p = end;
+    if(*p == '-') {
+      hi = strtol(p + 1, &end, 10);
+      p = end;
+    }
+    for(long v = lo; v <= hi && v < CPU_SETSIZE; ++v) CPU_SET(v, set);
+    if(*p == ',') ++p;
+  }
+  return 1;
+}
+
+// Fill 'cpus' with the CPUs this process may run on, grouped node by node,
+// and 'nodes' with each one's node.  Returns how many were stored, or 0 if
+// the topology is unknown.
+size_t mapnuma_cpus(int *cpus, int *nodes, size_t max) {
+  cpu_set_t allowed, online, node_cpus;
+  size_t count = 0;
+  char path[256];
+
+  if(sched_getaffinity(0, sizeof(allowed), &allowed)) return 0;
+  if(!_numa_read_list(NUMA_SYSFS "/online", &online)) return 0;
+
+  for(int node = 0; node < NUMA_MAX_NODES && node < CPU_SETSIZE; ++node) {
+    if(!CPU_ISSET(node, &online)) continue;
+    snprintf(path, sizeof(path), NUMA_SYSFS "/node%d/cpulist", node);
+    if(!_numa_read_list(path, &node_cpus)) continue;
+    for(int cpu = 0; cpu < CPU_SETSIZE && count < max; ++cpu) {
+      if(CPU_ISSET(cpu, &node_cpus) && CPU_ISSET(cpu, &allowed)) {
+        cpus[count] = cpu;
+        nodes[count] = node;
+        count += 1;
+      }
+    }
+  }
+  return count;
+}
+
+// Sum the allocation counters of every online node into 'nc'.  These are
+// host-wide:  there is no per-process equivalent to take a difference of.
+error_type mapnuma_counters(numa_counters_type *nc) {
+  cpu_set_t online;
+  char path[256], key[64];
+  unsigned long long value;
+
+  memset(nc, 0, sizeof(*nc));
+  if(!_numa_read_list(NUMA_SYSFS "/online", &online)) return FILE_OPEN_ERROR;
+
+  for(int node = 0; node < NUMA_MAX_NODES && node < CPU_SETSIZE; ++node) {
+    FILE *fp;
+    if(!CPU_ISSET(node, &online)) continue;
+    snprintf(path, sizeof(path), NUMA_SYSFS "/node%d/numastat", node);
+    if(NULL == (fp = fopen(path, "r"))) return FILE_OPEN_ERROR;
+    while(2 == fscanf(fp, "%63s %llu", key, &value)) {
+      if(!strcmp(key, "numa_hit"))        nc->hit += value;
+      else if(!strcmp(key, "numa_miss"))  nc->miss += value;
+      else if(!strcmp(key, "local_node")) nc->local_node += value;
+      else if(!strcmp(key, "other_node")) nc->other_node += value;
+    }
+    fclose(fp);
+    nc->nodes += 1;
+  }
+  return NO_ERROR;
+}
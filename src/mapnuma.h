@@ -0,0 +1,6 @@
+/// @file:  mapnuma.h
+///
+/// NUMA topology and counter declarations
+
+extern size_t     mapnuma_cpus(int *cpus, int *nodes, size_t max);
+extern error_type mapnuma_counters(numa_counters_type *nc);
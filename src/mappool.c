@@ -0,0 +1,715 @@
+/// @file:  mappool.c
+///
+/// Shared work-stealing task pool.
+///
+/// One pool serves every stage, so stages that each want the whole machine
+/// take turns on it instead of oversubscribing it.  Each worker owns a deque:
+/// it pushes and pops its own tasks at the bottom and, when that runs dry,
+/// steals from the top of the others'.  Threads outside the pool share one
+/// extra deque.  A thread blocked in pool_wait runs queued tasks until the one
+/// it waits on finishes, so waiting never idles a core and a pool with no
+/// workers at all still makes progress.
+///
+/// The pool starts on first use with one thread per online CPU (or
+/// MAPACH_THREADS, if set), counting the thread that waits;  call pool_start
+/// first to choose the count or to pin workers to CPUs.  Short of memory or
+/// threads, it runs with fewer workers, or none, rather than fail.
+///
+/// Under POOL_NUMA the parallel loops give up balancing for locality:  pass
+/// after pass, thread t (the caller being thread 0) runs the t-th of as many
+/// equal row bands as there are threads, posted to a mailbox it takes from
+/// before anything else.  mapdata_init zeroes new maps the same way, so each
+/// band's pages are first touched, and so placed, on the node of the thread
+/// that works on it.  A band posted while its thread is busy with some other
+/// task may be taken by any idle thread, so a loop never waits behind
+/// unrelated work;  that band alone runs off its node.
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "maptypes.h"
+#include "mapnuma.h"
+#include "mappool.h"
+
+#define POOL_MAX_THREADS 256
+
+// Each parallel_for chunk covers at least this many rows, and there are up
+// to this many chunks per thread for the thieves to balance.
+#define POOL_MIN_ROWS    16
+#define POOL_CHUNKS      4
+
+struct task_struct {
+  task_fn_type fn;
+  void         *arg;
+  size_t       blockers;   // Unfinished prerequisites, plus one until submitted
+  int          done;
+  size_t       nafter;
+  size_t       capafter;
+  task_type    **after;    // Tasks this one blocks
+};
+
+typedef struct {
+  pthread_mutex_t lock;
+  task_type       **ring;
+  size_t          capacity;
+  size_t          head;
+  size_t          count;
+} _deque_type;
+
+static struct {
+  pthread_mutex_t     lock;
+  pthread_cond_t      wake;       // Broadcast when a task is queued or finishes
+  int                 started;
+  int                 stopping;
+  pool_placement_type placement;
+  size_t              threads;
+  size_t              workers;
+  size_t              queued;
+  pthread_t           *tids;
+  _deque_type         *deques;    // One per worker, then the outside threads' one
+  _deque_type         *mailboxes; // One per worker, taken from by it alone
+  size_t              *posted;    // Tasks waiting in each mailbox
+  size_t              *busy;      // Tasks each worker is in the middle of
+  pthread_t           starter;    // The thread that started the pool
+  int                 starter_pinned;
+  cpu_set_t           starter_affinity; // The starter's own, to put back
+} _pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static __thread size_t _pool_self = (size_t)-1;
+
+// The deque this thread pushes to and pops from.
+size_t _pool_home(void) {
+  return _pool_self < _pool.workers ? _pool_self : _pool.workers;
+}
+
+error_type _deque_push(_deque_type *dq, task_type *task) {
+  pthread_mutex_lock(&dq->lock);
+  if(dq->count == dq->capacity) {
+    size_t capacity = dq->capacity ? 2 * dq->capacity : 64;
+    task_type **ring = malloc(capacity * sizeof(task_type *));
+    if(NULL == ring) {
+      pthread_mutex_unlock(&dq->lock);
+      return BUF_RESIZE_ERROR;
+    }
+    for(size_t i = 0; i < dq->count; ++i) {
+      ring[i] = dq->ring[(dq->head + i) % dq->capacity];
+    }
+    free(dq->ring);
+    dq->ring = ring;
+    dq->capacity = capacity;
+    dq->head = 0;
+  }
+  dq->ring[(dq->head + dq->count) % dq->capacity] = task;
+  dq->count += 1;
+  pthread_mutex_unlock(&dq->lock);
+  return NO_ERROR;
+}
+
+task_type *_deque_pop(_deque_type *dq) {
+  task_type *task = NULL;
+  pthread_mutex_lock(&dq->lock);
+  if(dq->count) {
+    dq->count -= 1;
+    task = dq->ring[(dq->head + dq->count) % dq->capacity];
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return task;
+}
+
+task_type *_deque_steal(_deque_type *dq) {
+  task_type *task = NULL;
+  pthread_mutex_lock(&dq->lock);
+  if(dq->count) {
+    task = dq->ring[dq->head];
+    dq->head = (dq->head + 1) % dq->capacity;
+    dq->count -= 1;
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return task;
+}
+
+void _pool_run(task_type *task);
+
+// A task that cannot be queued, for want of memory, runs here and now.
+void _pool_push(task_type *task) {
+  if(_deque_push(_pool.deques + _pool_home(), task)) {
+    _pool_run(task);
+    return;
+  }
+  pthread_mutex_lock(&_pool.lock);
+  _pool.queued += 1;
+  pthread_cond_broadcast(&_pool.wake);
+  pthread_mutex_unlock(&_pool.lock);
+}
+
+void _pool_post(size_t worker, task_type *task) {
+  if(_deque_push(_pool.mailboxes + worker, task)) {
+    _pool_run(task);
+    return;
+  }
+  pthread_mutex_lock(&_pool.lock);
+  _pool.posted[worker] += 1;
+  pthread_cond_broadcast(&_pool.wake);
+  pthread_mutex_unlock(&_pool.lock);
+}
+
+// Whether worker 'w' has posted tasks it is too busy to take.  Call with the
+// pool lock held.
+int _pool_stranded_locked(size_t w) {
+  return w != _pool_self && _pool.posted[w] && _pool.busy[w];
+}
+
+// Whether this thread has nothing to take.  Call with the pool lock held.
+int _pool_idle_locked(void) {
+  if(_pool.queued) return 0;
+  if(_pool_self < _pool.workers && _pool.posted[_pool_self]) return 0;
+  for(size_t w = 0; w < _pool.workers; ++w) {
+    if(_pool_stranded_locked(w)) return 0;
+  }
+  return 1;
+}
+
+// Take a task posted to a worker that is busy with another.
+task_type *_pool_take_stranded(void) {
+  task_type *task = NULL;
+
+  for(size_t w = 0; NULL == task && w < _pool.workers; ++w) {
+    pthread_mutex_lock(&_pool.lock);
+    int stranded = _pool_stranded_locked(w);
+    pthread_mutex_unlock(&_pool.lock);
+    if(stranded && NULL != (task = _deque_steal(_pool.mailboxes + w))) {
+      pthread_mutex_lock(&_pool.lock);
+      _pool.posted[w] -= 1;
+      pthread_mutex_unlock(&_pool.lock);
+    }
+  }
+  return task;
+}
+
+// Take this thread's oldest posted task, or else pop its newest queued one,
+// or else steal the oldest from the others, or else take a stranded one.
+task_type *_pool_take(void) {
+  size_t ndeques = _pool.workers + 1;
+  size_t home = _pool_home();
+  task_type *task;
+
+  if(_pool_self < _pool.workers &&
+     NULL != (task = _deque_steal(_pool.mailboxes + _pool_self))) {
+    pthread_mutex_lock(&_pool.lock);
+    _pool.posted[_pool_self] -= 1;
+    pthread_mutex_unlock(&_pool.lock);
+    return task;
+  }
+
+  task = _deque_pop(_pool.deques + home);
+
+  for(size_t i = 1; NULL == task && i < ndeques; ++i) {
+    task = _deque_steal(_pool.deques + (home + i) % ndeques);
+  }
+  if(NULL == task) return _pool_take_stranded();
+  pthread_mutex_lock(&_pool.lock);
+  _pool.queued -= 1;
+  pthread_mutex_unlock(&_pool.lock);
+  return task;
+}
+
+void _pool_run(task_type *task) {
+  int worker = _pool_self < _pool.workers;
+  task_type **ready;
+  size_t nready = 0;
+
+  // Anything already posted to this worker is stranded until it finishes.
+  if(worker) {
+    pthread_mutex_lock(&_pool.lock);
+    _pool.busy[_pool_self] += 1;
+    if(_pool.posted[_pool_self]) pthread_cond_broadcast(&_pool.wake);
+    pthread_mutex_unlock(&_pool.lock);
+  }
+  task->fn(task->arg);
+
+  // Gather the successors this releases at the front of the after list and
+  // take the list over, since the waiter may free the task once it is done.
+  pthread_mutex_lock(&_pool.lock);
+  for(size_t i = 0; i < task->nafter; ++i) {
+    if(--task->after[i]->blockers == 0) task->after[nready++] = task->after[i];
+  }
+  ready = task->after;
+  task->after = NULL;
+  task->nafter = task->capafter = 0;
+  task->done = 1;
+  if(worker) _pool.busy[_pool_self] -= 1;
+  pthread_cond_broadcast(&_pool.wake);
+  pthread_mutex_unlock(&_pool.lock);
+
+  for(size_t r = 0; r < nready; ++r) _pool_push(ready[r]);
+  free(ready);
+}
+
+void *_pool_worker(void *arg) {
+  _pool_self = (size_t)(uintptr_t)arg;
+
+  for(;;) {
+    task_type *task = _pool_take();
+    if(task) {
+      _pool_run(task);
+      continue;
+    }
+    pthread_mutex_lock(&_pool.lock);
+    while(_pool_idle_locked() && !_pool.stopping) {
+      pthread_cond_wait(&_pool.wake, &_pool.lock);
+    }
+    int quit = _pool.stopping && _pool_idle_locked();
+    pthread_mutex_unlock(&_pool.lock);
+    if(quit) break;
+  }
+  return NULL;
+}
+
+// Fill 'cpus' with the CPUs this process may run on, node by node where the
+// topology is known, so neighboring entries share a node.  Returns the count.
+size_t _pool_cpus(int cpus[CPU_SETSIZE]) {
+  int nodes[CPU_SETSIZE];
+  size_t count = mapnuma_cpus(cpus, nodes, CPU_SETSIZE);
+  cpu_set_t allowed;
+
+  if(count == 0) {
+    if(sched_getaffinity(0, sizeof(allowed), &allowed)) return 0;
+    for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if(CPU_ISSET(cpu, &allowed)) cpus[count++] = cpu;
+    }
+  }
+  return count;
+}
+
+// Pin worker 'w' to the (w + 1)th CPU this process may run on, leaving the
+// first for the thread that started the pool, so neighboring threads, and
+// under POOL_NUMA neighboring bands, share a node.
+void _pool_pin(size_t w) {
+  int cpus[CPU_SETSIZE];
+  size_t count = _pool_cpus(cpus);
+  cpu_set_t one;
+
+  if(count == 0) return;
+  CPU_ZERO(&one);
+  CPU_SET(cpus[(w + 1) % count], &one);
+  pthread_setaffinity_np(_pool.tids[w], sizeof(one), &one);
+}
+
+// Under POOL_NUMA the starting thread runs band 0, so it takes the first CPU
+// the workers leave it, keeping its old affinity to put back in pool_stop.
+void _pool_pin_starter(void) {
+  int cpus[CPU_SETSIZE];
+  size_t count = _pool_cpus(cpus);
+  cpu_set_t one;
+
+  _pool.starter = pthread_self();
+  _pool.starter_pinned = 0;
+  if(count == 0) return;
+  if(pthread_getaffinity_np(_pool.starter, sizeof(cpu_set_t), &_pool.starter_affinity)) return;
+  CPU_ZERO(&one);
+  CPU_SET(cpus[0], &one);
+  _pool.starter_pinned = !pthread_setaffinity_np(_pool.starter, sizeof(one), &one);
+}
+
+// Put the starter's affinity back, if this is the starter.
+void _pool_unpin_starter(void) {
+  if(_pool.starter_pinned && pthread_equal(pthread_self(), _pool.starter)) {
+    pthread_setaffinity_np(_pool.starter, sizeof(cpu_set_t), &_pool.starter_affinity);
+  }
+  _pool.starter_pinned = 0;
+}
+
+// A forked child inherits none of the workers and possibly some held locks,
+// so it forgets the parent's pool and starts its own, single-threaded unless
+// asked otherwise; forked children are normally parallel work themselves.
+// Nor does it keep the starter's pin, or every child would share one CPU.
+static size_t _pool_default_threads = 0;
+
+// What a pool with no workers needs, for when not even that much can be
+// allocated.  Every task then runs on the thread that waits on it.
+static pthread_t   _pool_solo_tid;
+static _deque_type _pool_solo_deques[2];
+static size_t      _pool_solo_posted;
+static size_t      _pool_solo_busy;
+
+void _pool_fork_prepare(void) {
+  pthread_mutex_lock(&_pool.lock);
+}
+
+void _pool_fork_parent(void) {
+  pthread_mutex_unlock(&_pool.lock);
+}
+
+void _pool_fork_child(void) {
+  _pool_unpin_starter();
+  pthread_mutex_init(&_pool.lock, NULL);
+  pthread_cond_init(&_pool.wake, NULL);
+  _pool.started = 0;
+  _pool.stopping = 0;
+  _pool.tids = NULL;
+  _pool.deques = NULL;
+  _pool.mailboxes = NULL;
+  _pool.posted = NULL;
+  _pool.busy = NULL;
+  memset(_pool_solo_deques, 0, sizeof(_pool_solo_deques));
+  _pool_solo_posted = 0;
+  _pool_self = (size_t)-1;
+  _pool_default_threads = 1;
+}
+
+error_type _pool_start_locked(size_t threads, pool_placement_type placement) {
+  static int atfork = 0;
+
+  if(!atfork) {
+    pthread_atfork(_pool_fork_prepare, _pool_fork_parent, _pool_fork_child);
+    atfork = 1;
+  }
+  if(threads == 0) threads = _pool_default_threads;
+  if(threads == 0) {
+    const char *env = getenv("MAPACH_THREADS");
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = env && atol(env) > 0 ? (size_t)atol(env) : ncpu > 0 ? (size_t)ncpu : 1;
+  }
+  if(threads > POOL_MAX_THREADS) threads = POOL_MAX_THREADS;
+
+  _pool.threads = threads;
+  _pool.workers = threads - 1;
+  _pool.queued = 0;
+  _pool.stopping = 0;
+  _pool.placement = placement;
+  _pool.tids = calloc(_pool.workers + 1, sizeof(pthread_t));
+  _pool.deques = calloc(_pool.workers + 1, sizeof(_deque_type));
+  _pool.mailboxes = calloc(_pool.workers + 1, sizeof(_deque_type));
+  _pool.posted = calloc(_pool.workers + 1, sizeof(size_t));
+  _pool.busy = calloc(_pool.workers + 1, sizeof(size_t));
+  if(NULL == _pool.tids || NULL == _pool.deques || NULL == _pool.mailboxes ||
+     NULL == _pool.posted || NULL == _pool.busy) {
+    free(_pool.tids);
+    free(_pool.deques);
+    free(_pool.mailboxes);
+    free(_pool.posted);
+    free(_pool.busy);
+    _pool.threads = 1;
+    _pool.workers = 0;
+    _pool.tids = &_pool_solo_tid;
+    _pool.deques = _pool_solo_deques;
+    _pool.mailboxes = _pool_solo_deques + 1;
+    _pool.posted = &_pool_solo_posted;
+    _pool.busy = &_pool_solo_busy;
+  }
+  for(size_t d = 0; d <= _pool.workers; ++d) {
+    pthread_mutex_init(&_pool.deques[d].lock, NULL);
+    pthread_mutex_init(&_pool.mailboxes[d].lock, NULL);
+  }
+
+  for(size_t w = 0; w < _pool.workers; ++w) {
+    if(pthread_create(_pool.tids + w, NULL, _pool_worker, (void *)(uintptr_t)w)) {
+      // Run with the workers that did start.
+      _pool.workers = w;
+      _pool.threads = w + 1;
+      break;
+    }
+    if(placement != POOL_FLOAT) _pool_pin(w);
+  }
+  if(placement == POOL_NUMA) _pool_pin_starter();
+
+  __atomic_store_n(&_pool.started, 1, __ATOMIC_RELEASE);
+  return NO_ERROR;
+}
+
+// Start the pool with 'threads' threads in all, the caller included (0 picks
+// the default), placing the workers as asked.  Only the first start, explicit
+// or implicit, has any effect.
+error_type pool_start(size_t threads, pool_placement_type placement) {
+  error_type e = NO_ERROR;
+  pthread_mutex_lock(&_pool.lock);
+  if(!_pool.started) e = _pool_start_locked(threads, placement);
+  pthread_mutex_unlock(&_pool.lock);
+  return e;
+}
+
+void _pool_ensure(void) {
+  if(!__atomic_load_n(&_pool.started, __ATOMIC_ACQUIRE)) pool_start(0, POOL_FLOAT);
+}
+
+// Finish every queued task, then stop the workers.  Called from the thread
+// that started the pool, this also puts back that thread's own affinity.
+// The pool may be started again afterwards.
+void pool_stop(void) {
+  pthread_mutex_lock(&_pool.lock);
+  if(!_pool.started) {
+    pthread_mutex_unlock(&_pool.lock);
+    return;
+  }
+  _pool.stopping = 1;
+  pthread_cond_broadcast(&_pool.wake);
+  pthread_mutex_unlock(&_pool.lock);
+
+  for(size_t w = 0; w < _pool.workers; ++w) pthread_join(_pool.tids[w], NULL);
+  while(pool_run_one());
+
+  for(size_t d = 0; d <= _pool.workers; ++d) {
+    pthread_mutex_destroy(&_pool.deques[d].lock);
+    pthread_mutex_destroy(&_pool.mailboxes[d].lock);
+    free(_pool.deques[d].ring);
+    free(_pool.mailboxes[d].ring);
+  }
+  if(_pool.deques == _pool_solo_deques) {
+    memset(_pool_solo_deques, 0, sizeof(_pool_solo_deques));
+    _pool_solo_posted = 0;
+  } else {
+    free(_pool.deques);
+    free(_pool.mailboxes);
+    free(_pool.posted);
+    free(_pool.busy);
+    free(_pool.tids);
+  }
+  _pool.deques = NULL;
+  _pool.mailboxes = NULL;
+  _pool.posted = NULL;
+  _pool.busy = NULL;
+  _pool.tids = NULL;
+  _pool_unpin_starter();
+  __atomic_store_n(&_pool.started, 0, __ATOMIC_RELEASE);
+}
+
+size_t pool_threads(void) {
+  _pool_ensure();
+  return _pool.threads;
+}
+
+// The running pool's placement.  Unlike the rest, this does not start it.
+pool_placement_type pool_placement(void) {
+  if(!__atomic_load_n(&_pool.started, __ATOMIC_ACQUIRE)) return POOL_FLOAT;
+  return _pool.placement;
+}
+
+// Create a task that will run 'fn(arg)' once it is submitted and everything
+// it was ordered after has finished.  Every task must be waited on.
+error_type pool_task(task_type **th, task_fn_type fn, void *arg) {
+  task_type *task = calloc(1, sizeof(task_type));
+  if(NULL == task) return BUF_ALLOC_ERROR;
+  task->fn = fn;
+  task->arg = arg;
+  task->blockers = 1;
+  *th = task;
+  return NO_ERROR;
+}
+
+// Hold 'task', which must not have been submitted yet, until 'before' has
+// finished.
+error_type pool_task_after(task_type *task, task_type *before) {
+  error_type e = NO_ERROR;
+
+  pthread_mutex_lock(&_pool.lock);
+  if(!before->done) {
+    if(before->nafter == before->capafter) {
+      size_t capafter = before->capafter ? 2 * before->capafter : 4;
+      task_type **after = realloc(before->after, capafter * sizeof(task_type *));
+      if(NULL == after) {
+        e = BUF_RESIZE_ERROR;
+        goto unlock;
+      }
+      before->after = after;
+      before->capafter = capafter;
+    }
+    before->after[before->nafter++] = task;
+    task->blockers += 1;
+  }
+ unlock:
+  pthread_mutex_unlock(&_pool.lock);
+  return e;
+}
+
+void pool_submit(task_type *task) {
+  int ready;
+
+  _pool_ensure();
+  pthread_mutex_lock(&_pool.lock);
+  ready = --task->blockers == 0;
+  pthread_mutex_unlock(&_pool.lock);
+  if(ready) _pool_push(task);
+}
+
+// Run one queued task on the calling thread.  Returns 0 if none was queued.
+int pool_run_one(void) {
+  task_type *task;
+
+  _pool_ensure();
+  if(NULL == (task = _pool_take())) return 0;
+  _pool_run(task);
+  return 1;
+}
+
+// Block until the task has run, helping with queued work meanwhile, then
+// release the handle.
+void pool_wait(task_type **th) {
+  task_type *task = *th;
+
+  for(;;) {
+    pthread_mutex_lock(&_pool.lock);
+    int done = task->done;
+    pthread_mutex_unlock(&_pool.lock);
+    if(done) break;
+    if(pool_run_one()) continue;
+
+    pthread_mutex_lock(&_pool.lock);
+    if(!task->done && _pool_idle_locked()) pthread_cond_wait(&_pool.wake, &_pool.lock);
+    pthread_mutex_unlock(&_pool.lock);
+  }
+
+  free(task->after);
+  free(task);
+  *th = NULL;
+}
+
+typedef struct {
+  rows_fn_type  rows_fn;
+  tiles_fn_type tiles_fn;
+  void          *arg;
+  size_t        width;
+  size_t        height;
+  size_t        chunk;     // Rows per chunk, or the tile edge
+  size_t        across;    // Tiles per row of tiles
+  size_t        count;
+  size_t        next;      // Next unclaimed chunk
+  size_t        bands;     // Under POOL_NUMA, one per thread
+} _pool_for_type;
+
+typedef struct {
+  _pool_for_type *pf;
+  size_t         band;
+} _pool_band_type;
+
+// Claim and run chunks until none are left.
+void _pool_for_chunks(void *arg) {
+  _pool_for_type *pf = arg;
+  size_t c;
+
+  while((c = __atomic_fetch_add(&pf->next, 1, __ATOMIC_RELAXED)) < pf->count) {
+    if(pf->rows_fn) {
+      size_t y1 = (c + 1) * pf->chunk;
+      pf->rows_fn(pf->arg, c * pf->chunk, y1 < pf->height ? y1 : pf->height);
+    } else {
+      size_t x0 = (c % pf->across) * pf->chunk;
+      size_t y0 = (c / pf->across) * pf->chunk;
+      size_t x1 = x0 + pf->chunk < pf->width ? x0 + pf->chunk : pf->width;
+      size_t y1 = y0 + pf->chunk < pf->height ? y0 + pf->chunk : pf->height;
+      pf->tiles_fn(pf->arg, x0, y0, x1, y1);
+    }
+  }
+}
+
+// Run the chunks on the caller and on one task per worker, each claiming
+// chunks as it frees up, so a stolen or late-starting helper still balances
+// the load.
+void _pool_for(_pool_for_type *pf) {
+  task_type *helpers[POOL_MAX_THREADS];
+  size_t nhelpers;
+
+  _pool_ensure();
+  nhelpers = _pool.workers < pf->count - 1 ? _pool.workers : pf->count - 1;
+  for(size_t h = 0; h < nhelpers; ++h) {
+    if(NO_ERROR == pool_task(helpers + h, _pool_for_chunks, pf)) {
+      pool_submit(helpers[h]);
+    } else {
+      helpers[h] = NULL;
+    }
+  }
+  _pool_for_chunks(pf);
+  for(size_t h = 0; h < nhelpers; ++h) {
+    if(helpers[h]) pool_wait(helpers + h);
+  }
+}
+
+// Run one thread's share of a POOL_NUMA loop:  its band of rows, or the
+// tiles whose top row falls in it.
+void _pool_for_band(void *arg) {
+  _pool_band_type *pb = arg;
+  _pool_for_type *pf = pb->pf;
+  size_t y0 = pb->band * pf->height / pf->bands;
+  size_t y1 = (pb->band + 1) * pf->height / pf->bands;
+
+  if(pf->rows_fn) {
+    if(y1 > y0) pf->rows_fn(pf->arg, y0, y1);
+    return;
+  }
+  for(size_t ty = (y0 + pf->chunk - 1) / pf->chunk; ty * pf->chunk < y1; ++ty) {
+    size_t ty1 = ty * pf->chunk + pf->chunk < pf->height ? ty * pf->chunk + pf->chunk : pf->height;
+    for(size_t x0 = 0; x0 < pf->width; x0 += pf->chunk) {
+      size_t x1 = x0 + pf->chunk < pf->width ? x0 + pf->chunk : pf->width;
+      pf->tiles_fn(pf->arg, x0, ty * pf->chunk, x1, ty1);
+    }
+  }
+}
+
+// Run band t on thread t:  the caller takes band 0 and worker w the band
+// w + 1, ahead of whatever else is queued, unless w is still busy with an
+// earlier task, in which case an idle thread takes it.
+void _pool_for_bands(_pool_for_type *pf) {
+  _pool_band_type bands[POOL_MAX_THREADS];
+  task_type *helpers[POOL_MAX_THREADS];
+
+  pf->bands = _pool.threads;
+  for(size_t b = 0; b < pf->bands; ++b) {
+    bands[b].pf = pf;
+    bands[b].band = b;
+  }
+  for(size_t w = 0; w < _pool.workers; ++w) {
+    if(NO_ERROR == pool_task(helpers + w, _pool_for_band, bands + w + 1)) {
+      helpers[w]->blockers = 0;
+      _pool_post(w, helpers[w]);
+    } else {
+      helpers[w] = NULL;
+    }
+  }
+  _pool_for_band(bands);
+  for(size_t w = 0; w < _pool.workers; ++w) {
+    if(helpers[w]) pool_wait(helpers + w);
+    else           _pool_for_band(bands + w + 1);
+  }
+}
+
+// Split [0, rows) into bands and run 'fn' over each, in parallel.
+void pool_parallel_rows(rows_fn_type fn, void *arg, size_t rows) {
+  _pool_for_type pf = { fn, NULL, arg, 0, rows, 0, 0, 0, 0, 0 };
+
+  if(pool_placement() == POOL_NUMA && _pool.workers && rows) {
+    _pool_for_bands(&pf);
+    return;
+  }
+  pf.chunk = rows / (POOL_CHUNKS * pool_threads());
+  if(pf.chunk < POOL_MIN_ROWS) pf.chunk = POOL_MIN_ROWS;
+  pf.count = (rows + pf.chunk - 1) / pf.chunk;
+  if(pf.count < 2) {
+    if(rows) fn(arg, 0, rows);
+    return;
+  }
+  _pool_for(&pf);
+}
+
+// Cut a width x height grid into tile x tile squares (clipped at the right
+// and bottom edges) and run 'fn' over each, in parallel.
+void pool_parallel_tiles(tiles_fn_type fn, void *arg,
+                         size_t width, size_t height, size_t tile) {
+  _pool_for_type pf = { NULL, fn, arg, width, height, tile, 0, 0, 0, 0 };
+
+  if(width == 0 || height == 0) return;
+  if(pool_placement() == POOL_NUMA && _pool.workers) {
+    _pool_for_bands(&pf);
+    return;
+  }
+  pf.across = (width + tile - 1) / tile;
+  pf.count = pf.across * ((height + tile - 1) / tile);
+  if(pf.count < 2) {
+    fn(arg, 0, 0, width, height);
+    return;
+  }
+  _pool_for(&pf);
+}
@@ -0,0 +1,18 @@
+/// @file:  mappool.h
+///
+/// Shared work-stealing task pool declarations
+
+extern error_type          pool_start(size_t threads, pool_placement_type placement);
+extern void                pool_stop(void);
+extern size_t              pool_threads(void);
+extern pool_placement_type pool_placement(void);
+
+extern error_type pool_task(task_type **th, task_fn_type fn, void *arg);
+extern error_type pool_task_after(task_type *task, task_type *before);
+extern void       pool_submit(task_type *task);
+extern void       pool_wait(task_type **th);
+extern int        pool_run_one(void);
+
+extern void       pool_parallel_rows(rows_fn_type fn, void *arg, size_t rows);
+extern void       pool_parallel_tiles(tiles_fn_type fn, void *arg,
+                                      size_t width, size_t height, size_t tile);
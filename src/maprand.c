@@ -0,0 +1,93 @@
+/// @file:  maprand.c
+///
+/// Random numbers.  The generator is xoshiro256**, seeded through splitmix64.
+/// Every stream is a pure function of (seed, stream), so work that is split
+/// into tiles can give each tile its own stream and produce the same output
+/// no matter how many threads, or in what order, the tiles are run.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "maptypes.h"
+#include "maprand.h"
+
+uint64_t _splitmix64(uint64_t *x) {
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+uint64_t _rotl(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+void rand_seed(rand_type *rng, uint64_t seed) {
+  rand_stream(rng, seed, 0);
+}
+
+// The seed and the stream are hashed on different keys before they are
+// combined, so swapping them, or taking stream 0 of one seed for some
+// stream of seed 0, gives another sequence.
+#define RAND_STREAM_KEY 0xd1b54a32d192ed03ULL
+
+void rand_stream(rand_type *rng, uint64_t seed, uint64_t stream) {
+  uint64_t x = seed;
+  uint64_t y = stream ^ RAND_STREAM_KEY;
+  x = _splitmix64(&x);
+  x += _splitmix64(&y);
+  for(size_t i = 0; i < 4; ++i) {
+    rng->s[i] = _splitmix64(&x);
+  }
+}
+
+uint64_t rand_next(rand_type *rng) {
+  uint64_t *s = rng->s;
+  uint64_t result = _rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = _rotl(s[3], 45);
+
+  return result;
+}
+
+// Uniform on [0, bound), without modulo bias (Lemire's multiply-and-reject).
+size_t rand_below(rand_type *rng, size_t bound) {
+  unsigned __int128 m = (unsigned __int128)rand_next(rng) * bound;
+  uint64_t low = (uint64_t)m;
+  if(low < bound) {
+    uint64_t threshold = -(uint64_t)bound % bound;
+    while(low < threshold) {
+      m = (unsigned __int128)rand_next(rng) * bound;
+      low = (uint64_t)m;
+    }
+  }
+  return (size_t)(m >> 64);
+}
+
+// Uniform on [0, 1), with 53 random bits.
+double rand_unit(rand_type *rng) {
+  return (rand_next(rng) >> 11) * 0x1.0p-53;
+}
+
+void rand_fill(rand_type *rng, uint64_t *buf, size_t count) {
+  uint64_t s0 = rng->s[0], s1 = rng->s[1], s2 = rng->s[2], s3 = rng->s[3];
+  
+  for(size_t i = 0; i < count; ++i) {
+    uint64_t t = s1 << 17;
+    buf[i] = _rotl(s1 * 5, 7) * 9;
+    s2 ^= s0;
+    s3 ^= s1;
+    s1 ^= s2;
+    s0 ^= s3;
+    s2 ^= t;
+    s3 = _rotl(s3, 45);
+  }
+
+  rng->s[0] = s0; rng->s[1] = s1; rng->s[2] = s2; rng->s[3] = s3;
+}
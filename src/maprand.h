@@ -0,0 +1,10 @@
+/// @file:  maprand.h
+///
+/// Random number declarations
+
+extern void     rand_seed  (rand_type *rng, uint64_t seed);
+extern void     rand_stream(rand_type *rng, uint64_t seed, uint64_t stream);
+extern uint64_t rand_next  (rand_type *rng);
+extern size_t   rand_below (rand_type *rng, size_t bound);
+extern double   rand_unit  (rand_type *rng);
+extern void     rand_fill  (rand_type *rng, uint64_t *buf, size_t count);
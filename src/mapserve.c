@@ -0,0 +1,265 @@
+/// @file:  mapserve.c
+///
+/// Generation server.
+///
+/// Listens on a UNIX stream socket and answers one request per line:
+///
+///   seed=N dim=N | width=N height=N  slope=S gen=S rain=R omicron=O
+///   workers=N png=PATH shade=PATH normal=PATH raw=PATH
+///
+/// Every key is optional.  Maps default to 1081 cells square, about a third
+/// of main's 3242 so that a bare request answers in minutes rather than hours;
+/// the other defaults are main's.  'slope' is the eroded slope limit and 'gen'
+/// the rough generation slope, both in height units per cell, and 'workers'
+/// erodes in that many processes.  Each output is the whole map:  the
+/// heightmap scaled from its lowest point, its hillshade, or its normal map.
+/// Maps run from 16 to 16384 cells on a side.  The reply is a single line,
+/// "ok" with the timings in milliseconds, or "error" and the reason, running
+/// out of memory included.  A line reading "quit" stops the server.
+///
+/// The map grid, the thread pool and the server's own buffers stay allocated
+/// between requests of the same size, so a warm request pays neither the
+/// allocation nor the page faults of a fresh process.
+
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "maptypes.h"
+#include "mapach.h"
+#include "mapdist.h"
+#include "mapexport.h"
+#include "maprand.h"
+#include "mapserve.h"
+
+// Requested maps must be this many cells across, or more, and no more than
+// the largest a server is expected to hold.
+#define SERVE_MIN_DIM 16
+#define SERVE_MAX_DIM 16384
+
+typedef struct {
+  uint64_t seed;
+  size_t   width;
+  size_t   height;
+  double   max_slope;
+  double   gen_slope;
+  double   rainwater;
+  double   omicron;
+  double   cell_size;
+  size_t   workers;
+  char     *png;
+  char     *shade;
+  char     *normal;
+  char     *raw;
+} _request_type;
+
+double _serve_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+// Fill 'req' from a request line, which is modified.  Returns the first
+// unknown or malformed word, or NULL.
+const char *_serve_parse(_request_type *req, char *line) {
+  const double pixelheight = 1024.0 / 65535.0;
+  const double pixelres = 16.65 / 2.0;
+  const double max_grade = 0.71;
+  int gen_given = 0;
+  char *save = NULL;
+
+  req->seed = time(NULL);
+  req->width = req->height = 1081;
+  req->max_slope = max_grade * pixelres / pixelheight;
+  req->rainwater = 0.23;
+  req->omicron = 2;
+  req->cell_size = pixelres / pixelheight;
+  req->workers = 0;
+  req->png = req->shade = req->normal = req->raw = NULL;
+
+  for(char *word = strtok_r(line, " \t\r\n", &save); word;
+      word = strtok_r(NULL, " \t\r\n", &save)) {
+    char *value = strchr(word, '=');
+    char *end = NULL;
+    if(NULL == value) return word;
+    *value++ = '\0';
+
+    if(!strcmp(word, "png"))           req->png = value;
+    else if(!strcmp(word, "shade"))    req->shade = value;
+    else if(!strcmp(word, "normal"))   req->normal = value;
+    else if(!strcmp(word, "raw"))      req->raw = value;
+    else if(!strcmp(word, "seed"))     req->seed = strtoull(value, &end, 0);
+    else if(!strcmp(word, "dim"))      req->width = req->height = strtoul(value, &end, 0);
+    else if(!strcmp(word, "width"))    req->width = strtoul(value, &end, 0);
+    else if(!strcmp(word, "height"))   req->height = strtoul(value, &end, 0);
+    else if(!strcmp(word, "workers"))  req->workers = strtoul(value, &end, 0);
+    else if(!strcmp(word, "slope"))    req->max_slope = strtod(value, &end);
+    else if(!strcmp(word, "rain"))     req->rainwater = strtod(value, &end);
+    else if(!strcmp(word, "omicron"))  req->omicron = strtod(value, &end);
+    else if(!strcmp(word, "gen")) {
+      req->gen_slope = strtod(value, &end);
+      gen_given = 1;
+    } else {
+      return word;
+    }
+    if(end && (end == value || *end)) return word;
+  }
+  if(!gen_given) req->gen_slope = req->max_slope * 0.04;
+  return NULL;
+}
+
+// Generate one map into '*mdh', reusing it when the size matches, and write
+// the requested outputs.  Times go into 'ms':  generation, erosion, output.
+error_type _serve_one(mapdata_type **mdh, _request_type *req, double ms[3]) {
+  mapdata_type *md = *mdh;
+  error_type e;
+  rand_type rng;
+  double t0, t1, t2, t3;
+
+  if(req->width < SERVE_MIN_DIM || req->width > SERVE_MAX_DIM ||
+     req->height < SERVE_MIN_DIM || req->height > SERVE_MAX_DIM) {
+    return DIM_ERROR;
+  }
+
+  t0 = _serve_ms();
+  if(md && (md->dim.x != req->width || md->dim.y != req->height)) mapdata_free(mdh);
+  if(NULL == *mdh) {
+    if(NO_ERROR != (e = mapdata_init(mdh, req->width, req->height))) return e;
+  } else {
+    mapdata_reset(*mdh);
+  }
+  md = *mdh;
+
+  rand_seed(&rng, req->seed);
+  if(NO_ERROR != (e = mapdata_rough_gen(md, &rng, req->gen_slope, req->rainwater, NULL))) return e;
+  t1 = _serve_ms();
+
+  if(req->workers) {
+    e = mapdata_erode_distributed(md, req->workers, 0,
+                                  req->gen_slope, req->max_slope, req->omicron);
+  } else {
+    e = mapdata_erode(md, req->gen_slope, req->max_slope, req->omicron);
+  }
+  if(NO_ERROR != e) return e;
+  t2 = _serve_ms();
+
+  if(req->png || req->shade || req->normal || req->raw) {
+    double lo = INFINITY, hi = -INFINITY;
+    for(size_t idx = 0; idx < md->size; ++idx) {
+      double elev = md->data[idx].elevation;
+      if(elev < lo) lo = elev;
+      if(elev > hi) hi = elev;
+    }
+    double white = hi - lo > 65535 ? hi : lo + 65535;
+    export_type *ex = NULL;
+
+    if(req->png || req->shade || req->normal) {
+      e = mapdata_export_maps(&ex, req->png, req->shade, req->normal, md,
+                              0, 0, md->dim.x, md->dim.y, lo, white, req->cell_size);
+    }
+    if(NO_ERROR == e && req->raw) {
+      FILE *fp = fopen(req->raw, "wb");
+      if(NULL == fp) {
+        e = FILE_OPEN_ERROR;
+      } else {
+        e = mapdata_write_raw(fp, md, 0, 0, md->dim.x, md->dim.y, lo, white, RAW_U16_LE);
+        if(fclose(fp) && NO_ERROR == e) e = FILE_WRITE_ERROR;
+      }
+    }
+    if(ex) {
+      error_type we = mapdata_export_wait(&ex);
+      if(NO_ERROR == e) e = we;
+    }
+  }
+  t3 = _serve_ms();
+
+  ms[0] = t1 - t0;
+  ms[1] = t2 - t1;
+  ms[2] = t3 - t2;
+  return e;
+}
+
+// Serve requests on the UNIX socket at 'path', replacing any stale socket
+// there, until a client sends "quit".
+error_type mapach_serve(const char *path) {
+  struct sockaddr_un addr;
+  mapdata_type *md = NULL;
+  char *line = NULL;
+  size_t linecap = 0;
+  int running = 1;
+  int lfd;
+
+  if(strlen(path) >= sizeof(addr.sun_path)) return FILE_OPEN_ERROR;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  signal(SIGPIPE, SIG_IGN);
+  unlink(path);
+  if(-1 == (lfd = socket(AF_UNIX, SOCK_STREAM, 0))) return FILE_OPEN_ERROR;
+  if(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) || listen(lfd, 8)) {
+    close(lfd);
+    return FILE_OPEN_ERROR;
+  }
+  printf("Serving on %s\n", path);
+  fflush(stdout);
+
+  while(running) {
+    int cfd = accept(lfd, NULL, NULL);
+    FILE *in;
+
+    if(cfd < 0) {
+      if(errno == EINTR) continue;
+      break;
+    }
+    if(NULL == (in = fdopen(cfd, "r"))) {
+      close(cfd);
+      continue;
+    }
+
+    while(running && getline(&line, &linecap, in) > 0) {
+      _request_type req;
+      const char *bad;
+      double ms[3];
+      double t0 = _serve_ms();
+      error_type e;
+
+      if(!strncmp(line, "quit", 4)) {
+        running = 0;
+        dprintf(cfd, "ok bye\n");
+        break;
+      }
+      if(NULL != (bad = _serve_parse(&req, line))) {
+        dprintf(cfd, "error bad parameter: %s\n", bad);
+        continue;
+      }
+
+      e = _serve_one(&md, &req, ms);
+      if(NO_ERROR != e) {
+        dprintf(cfd, "error %s\n", map_error_to_str(e));
+        continue;
+      }
+      double total = _serve_ms() - t0;
+      dprintf(cfd, "ok seed=%lu dim=%ldx%ld gen_ms=%.1f erode_ms=%.1f write_ms=%.1f total_ms=%.1f\n",
+              (unsigned long)req.seed, req.width, req.height, ms[0], ms[1], ms[2], total);
+      printf("Request:  seed %lu, %ldx%ld, %.1f ms\n",
+             (unsigned long)req.seed, req.width, req.height, total);
+      fflush(stdout);
+    }
+    fclose(in);
+  }
+
+  free(line);
+  if(md) mapdata_free(&md);
+  close(lfd);
+  unlink(path);
+  return NO_ERROR;
+}
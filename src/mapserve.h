@@ -0,0 +1,5 @@
+/// @file:  mapserve.h
+///
+/// Generation server declarations
+
+extern error_type mapach_serve(const char *path);
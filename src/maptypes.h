@@ -2,6 +2,9 @@
 ///
 /// Common location for typedefs
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef int group_type;
 
 typedef struct {
@@ -18,24 +21,65 @@ typedef struct {
 typedef struct {
   coord_type dim;
   size_t     size;
+  int        pow2;      // Both dimensions are powers of two
+  unsigned   shift_x;   // log2(dim.x), when pow2
+  size_t     mask_x;    // dim.x - 1, when pow2
+  size_t     mask_y;    // dim.y - 1, when pow2
+  uint64_t   recip_x;   // ceil(2^64 / dim.x) when not pow2 and size * dim.x
+                        // fits in 64 bits, else 0
   coord_type dir_offset[8];
+  coord_type dirty0;    // First dirty cell
+  coord_type dirty_len; // Dirty extent from dirty0, wrapping; none when .x is 0
   datum_type *data;
 } mapdata_type;
 
+// One level of a mip chain:  elevations only, row-major.
+typedef struct {
+  coord_type dim;
+  double     *elevation;
+} mip_level_type;
+
+typedef struct {
+  uint64_t s[4];
+} rand_type;
+
 typedef struct {
   size_t size;
   size_t capacity;
   size_t data[];
 } array_type;
 
+typedef struct {
+  array_type *cells;
+  uint64_t   *queued;
+  size_t     map_size;
+  size_t     peak;      // Most entries held at once
+} frontier_type;
+
 typedef enum {
   NO_ERROR = 0,
   MD_MEMORY_ERROR,
   BUF_ALLOC_ERROR,
   BUF_RESIZE_ERROR,
   PNG_GEN_ERROR,
+  FILE_OPEN_ERROR,
+  THREAD_ERROR,
+  FILE_WRITE_ERROR,
+  PROCESS_ERROR,
+  DIM_ERROR,
 } error_type;
 
+// RAW_U16_* scale black..white to 0..65535 as the PNGs do, RAW_F32_* write
+// the elevations themselves, and RAW_F32_UNIT_* scale black..white to 0..1.
+typedef enum {
+  RAW_U16_LE = 0,
+  RAW_U16_BE,
+  RAW_F32_LE,
+  RAW_F32_BE,
+  RAW_F32_UNIT_LE,
+  RAW_F32_UNIT_BE,
+} raw_format_type;
+
 // Clockwise around.
 // 7 0 1
 // 6 C 2
@@ -53,7 +97,84 @@ typedef enum {
   DIR_ENUM_SIZE,
 } direction_type;
 
+typedef struct export_struct export_type;
+typedef struct task_struct task_type;
+
+// Where the pool's workers run.  POOL_NUMA pins them node by node and hands
+// each the same band of rows in every parallel pass, which is also the band
+// whose pages it touches first when a map is allocated.
+typedef enum {
+  POOL_FLOAT = 0,
+  POOL_PIN,
+  POOL_NUMA,
+} pool_placement_type;
+
+// Page allocation counters, summed over every node, as the kernel keeps them
+// in /sys/devices/system/node/node*/numastat.  They count the whole system,
+// not just this process.
+typedef struct {
+  size_t   nodes;
+  uint64_t hit;          // Allocated on the node that was asked for
+  uint64_t miss;         // Asked for another node, which was full
+  uint64_t local_node;   // Allocated on the node of the faulting CPU
+  uint64_t other_node;   // Allocated on a node other than the faulting CPU's
+} numa_counters_type;
+
+// While eroding, a cell's group records where it stands.  Every engine
+// leaves the whole map ERODE_DONE, which is what mapdata_erode_dirty expects.
+typedef enum {
+  ERODE_DONE = 0,   // Popped; only revisited if something lowers it.
+  ERODE_OPEN,       // Not yet queued.
+  ERODE_QUEUED,     // Waiting in the pending arrays.
+} erode_state_type;
+
+typedef struct {
+  size_t off;     // Stencil offset of the first cell, biased by the dimension
+  size_t v0;      // Wrapped coordinate of the first cell
+  size_t len;
+  size_t tile;    // Tile row or column
+  size_t magmin;  // Smallest |offset| in the run
+} erode_seg_type;
+
+typedef struct {
+  mapdata_type   *md;
+  array_type     *pending_by_index;
+  array_type     *pending_by_height;
+  double         river_slope;
+  double         max_slope;
+  double         omicron;
+  double         omicronsq;
+  coord_type     tiles;
+  double         *tile_max;
+  unsigned char  *tile_stale;
+  size_t         *tile_open;
+  erode_seg_type *xseg;
+  erode_seg_type *yseg;
+  size_t         hspan_max;   // Widest stencil half-span
+  size_t         own0;        // Only rows [own0, own1) may be lowered
+  size_t         own1;
+  size_t         lowered;     // Cells lowered so far
+  error_type     error;       // First failure to grow the pending queues
+} erode_type;
+
+// How a worker holding one band of a distributed map reaches the others.
+// Rows are addressed in the whole map's coordinates.  put_rows publishes
+// elevations, get_rows fetches elevation and water, reduce is a barrier
+// across all workers that returns the sum of everyone's 'value', and
+// barrier is the same without the sum.
+typedef struct transport_struct transport_type;
+struct transport_struct {
+  error_type (*put_rows)(transport_type *tp, size_t y, const datum_type *rows, size_t count);
+  error_type (*get_rows)(transport_type *tp, size_t y, datum_type *rows, size_t count);
+  error_type (*reduce)(transport_type *tp, size_t value, size_t *total);
+  error_type (*barrier)(transport_type *tp);
+  void       *state;
+};
+
 typedef int(*predicate_fn_type)(size_t, void*);
+typedef void(*rows_fn_type)(void*, size_t, size_t);
+typedef void(*tiles_fn_type)(void*, size_t, size_t, size_t, size_t);
+typedef void(*task_fn_type)(void*);
 
 typedef struct {
   double       height;
@@ -0,0 +1,297 @@
+/// @file:  test_mapach.c
+///
+/// Checks on the map generator that need a whole map to run.
+///
+/// The dirty-erosion check erodes a rough map, edits a patch that wraps
+/// around the corner of the torus, and requires mapdata_erode_dirty to land
+/// on exactly the surface a full mapdata_erode of the edited map gives.
+/// Distributed erosion must match mapdata_erode the same way.  The mip-chain
+/// check compares the one-pass chain against repeated mapdata_copy.  The
+/// stream check requires rand_stream to tell its two arguments apart, and
+/// the rough-map check pins mapdata_rough_gen's output for fixed seeds.  The
+/// band check requires a POOL_NUMA loop to finish while a worker is held up
+/// by an unrelated task, and the thread that started the pool to get its own
+/// CPUs back from pool_stop.
+///
+/// Usage:  test_mapach [seed [dim]]
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "maptypes.h"
+#include "mapach.h"
+#include "mapdist.h"
+#include "mappool.h"
+#include "maprand.h"
+
+// main's settings.
+const double pixelheight = 1024.0 / 65535.0;
+const double pixelres = 16.65 / 2.0;
+const double max_grade = 0.71;
+const double rainwater = 0.23;
+const double omicron = 2;
+
+void _require(error_type e) {
+  if(e) {
+    printf("FAIL:  %s\n", map_error_to_str(e));
+    exit(2);
+  }
+}
+
+void _check_fail(const char *what, size_t where) {
+  printf("FAIL:  %s mismatch at %ld\n", what, where);
+  exit(1);
+}
+
+void _check_dirty_erode(uint64_t seed, size_t dim) {
+  const double max_slope = max_grade * pixelres / pixelheight;
+  const double gen_slope = max_slope * 0.04;
+  mapdata_type *mddirty, *mdfull;
+  rand_type rng;
+
+  rand_seed(&rng, seed);
+  _require(mapdata_init(&mddirty, dim, dim));
+  _require(mapdata_init(&mdfull, dim, dim));
+  _require(mapdata_rough_gen(mddirty, &rng, gen_slope, rainwater, NULL));
+  _require(mapdata_erode(mddirty, gen_slope, max_slope, omicron));
+
+  // Raise a ridge and dig a pit across the corner, where x and y both wrap.
+  for(size_t dy = 0; dy < 12; ++dy) {
+    for(size_t dx = 0; dx < 12; ++dx) {
+      size_t idx = mapdata_xy_to_idx(mddirty, (dim - 6 + dx) % dim, (dim - 6 + dy) % dim);
+      mddirty->data[idx].elevation += (dx == dy) ? -300.0 : 200.0 * rand_unit(&rng);
+    }
+  }
+  mapdata_mark_dirty(mddirty, dim - 6, dim - 6, dim + 6, dim + 6);
+  memcpy(mdfull->data, mddirty->data, mddirty->size * sizeof(datum_type));
+
+  _require(mapdata_erode_dirty(mddirty, gen_slope, max_slope, omicron));
+  _require(mapdata_erode(mdfull, gen_slope, max_slope, omicron));
+
+  for(size_t idx = 0; idx < mdfull->size; ++idx) {
+    if(mddirty->data[idx].elevation != mdfull->data[idx].elevation) {
+      _check_fail("dirty erosion", idx);
+    }
+  }
+  printf("dirty erosion:  ok\n");
+
+  mapdata_free(&mddirty);
+  mapdata_free(&mdfull);
+}
+
+// Distributed erosion, with the default halo, must land on exactly what
+// mapdata_erode computes.
+void _check_distributed_erode(uint64_t seed, size_t dim) {
+  const double max_slope = max_grade * pixelres / pixelheight;
+  const double gen_slope = max_slope * 0.04;
+  mapdata_type *mdserial, *mddist;
+  rand_type rng;
+
+  rand_seed(&rng, seed);
+  _require(mapdata_init(&mdserial, dim, dim));
+  _require(mapdata_init(&mddist, dim, dim));
+  _require(mapdata_rough_gen(mdserial, &rng, gen_slope, rainwater, NULL));
+  memcpy(mddist->data, mdserial->data, mdserial->size * sizeof(datum_type));
+
+  _require(mapdata_erode(mdserial, gen_slope, max_slope, omicron));
+  _require(mapdata_erode_distributed(mddist, 3, 0, gen_slope, max_slope, omicron));
+
+  for(size_t idx = 0; idx < mdserial->size; ++idx) {
+    if(mddist->data[idx].elevation != mdserial->data[idx].elevation) {
+      _check_fail("distributed erosion", idx);
+    }
+  }
+  printf("distributed erosion:  ok\n");
+
+  mapdata_free(&mdserial);
+  mapdata_free(&mddist);
+}
+
+// Streams must not collide when the seed and stream are swapped, nor when
+// rand_seed's stream 0 is taken for some stream of seed 0.
+void _check_rand_streams(void) {
+  const uint64_t values[] = { 0, 1, 2, 3, 42, 12345, 0x9e3779b97f4a7c15ULL, UINT64_MAX };
+  const size_t count = sizeof(values) / sizeof(values[0]);
+  rand_type ab, ba;
+
+  for(size_t i = 0; i < count; ++i) {
+    for(size_t j = 0; j < count; ++j) {
+      if(i == j) continue;
+      rand_stream(&ab, values[i], values[j]);
+      rand_stream(&ba, values[j], values[i]);
+      if(!memcmp(ab.s, ba.s, sizeof(ab.s))) _check_fail("swapped stream", i * count + j);
+    }
+    if(values[i] == 0) continue;
+    rand_seed(&ab, values[i]);
+    rand_stream(&ba, 0, values[i]);
+    if(!memcmp(ab.s, ba.s, sizeof(ab.s))) _check_fail("seed and stream 0", i);
+  }
+  printf("rand streams:  ok\n");
+}
+
+// Rough generation is pinned to the maps it made for a few fixed seeds, as
+// FNV-1a hashes over the elevation, water and group of every cell.
+typedef struct {
+  uint64_t seed;
+  size_t   dim_x;
+  size_t   dim_y;
+  uint64_t hash;
+} _rough_case_type;
+
+const _rough_case_type _rough_cases[] = {
+  { 12345,  96,  80, 0xf67eb6b867366c9dULL },
+  { 12345, 128, 128, 0x54ebc6b295fa8daeULL },
+  {     3,  33,  47, 0x75e579d34ebc0f9dULL },
+  {    11, 256,  32, 0x80ceb51a62f6fb7aULL },
+};
+
+void _check_rough_gen(void) {
+  const double max_slope = max_grade * pixelres / pixelheight;
+  const double gen_slope = max_slope * 0.04;
+
+  for(size_t c = 0; c < sizeof(_rough_cases) / sizeof(_rough_cases[0]); ++c) {
+    const _rough_case_type *rc = _rough_cases + c;
+    mapdata_type *md;
+    rand_type rng;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t peak;
+
+    rand_seed(&rng, rc->seed);
+    _require(mapdata_init(&md, rc->dim_x, rc->dim_y));
+    _require(mapdata_rough_gen(md, &rng, gen_slope, rainwater, &peak));
+    if(peak == 0 || peak > md->size) _check_fail("frontier peak", c);
+    const unsigned char *bytes = (const unsigned char *)md->data;
+    for(size_t b = 0; b < md->size * sizeof(datum_type); ++b) {
+      hash = (hash ^ bytes[b]) * 0x100000001b3ULL;
+    }
+    mapdata_free(&md);
+    if(hash != rc->hash) {
+      printf("rough map for seed %lu at %ldx%ld hashes to 0x%016lx\n",
+             (unsigned long)rc->seed, rc->dim_x, rc->dim_y, (unsigned long)hash);
+      _check_fail("rough map", c);
+    }
+  }
+  printf("rough maps:  ok\n");
+}
+
+// The one-pass mip chain must match halving the map again and again with
+// mapdata_copy, on dimensions that do not halve evenly.
+void _check_mip_chain(uint64_t seed, size_t dim) {
+  const size_t count = 7;
+  mapdata_type *md, *prev, *next;
+  mip_level_type levels[count];
+  rand_type rng;
+
+  rand_seed(&rng, seed);
+  _require(mapdata_init(&md, dim * 3 / 2 + 1, dim - 3));
+  for(size_t idx = 0; idx < md->size; ++idx) {
+    md->data[idx].elevation = 1000.0 * rand_unit(&rng);
+  }
+  _require(mapdata_mip_chain(md, levels, count));
+
+  prev = md;
+  for(size_t level = 0; level < count; ++level) {
+    _require(mapdata_init(&next, prev->dim.x > 1 ? prev->dim.x / 2 : 1,
+                          prev->dim.y > 1 ? prev->dim.y / 2 : 1));
+    _require(mapdata_copy(prev, next));
+    if(next->dim.x != levels[level].dim.x || next->dim.y != levels[level].dim.y) {
+      _check_fail("mip level size", level);
+    }
+    for(size_t idx = 0; idx < next->size; ++idx) {
+      if(next->data[idx].elevation != levels[level].elevation[idx]) {
+        _check_fail("mip level", level);
+      }
+    }
+    if(prev != md) mapdata_free(&prev);
+    prev = next;
+  }
+  printf("mip chain:  ok\n");
+
+  mapdata_free(&prev);
+  mapdata_free(&md);
+  mip_chain_free(levels, count);
+}
+
+typedef struct {
+  int started;
+  int released;
+  int timed_out;
+} _hold_type;
+
+// Hold a worker until released, or for five seconds at most.
+void _hold_worker(void *arg) {
+  _hold_type *hold = arg;
+  time_t give_up = time(NULL) + 5;
+
+  __atomic_store_n(&hold->started, 1, __ATOMIC_RELEASE);
+  while(!__atomic_load_n(&hold->released, __ATOMIC_ACQUIRE)) {
+    if(time(NULL) > give_up) {
+      hold->timed_out = 1;
+      break;
+    }
+    nanosleep(&(struct timespec){ 0, 1000000 }, NULL);
+  }
+}
+
+void _count_rows(void *arg, size_t y0, size_t y1) {
+  __atomic_fetch_add((size_t *)arg, y1 - y0, __ATOMIC_RELAXED);
+}
+
+// Under POOL_NUMA, a loop whose band belongs to a busy worker must not wait
+// for that worker.
+void _check_numa_bands(void) {
+  _hold_type hold = { 0, 0, 0 };
+  task_type *task;
+  size_t rows = 0;
+  cpu_set_t before, during, after;
+
+  pthread_getaffinity_np(pthread_self(), sizeof(before), &before);
+  _require(pool_start(4, POOL_NUMA));
+  pthread_getaffinity_np(pthread_self(), sizeof(during), &during);
+  _require(pool_task(&task, _hold_worker, &hold));
+  pool_submit(task);
+  while(!__atomic_load_n(&hold.started, __ATOMIC_ACQUIRE)) {
+    nanosleep(&(struct timespec){ 0, 1000000 }, NULL);
+  }
+  pool_parallel_rows(_count_rows, &rows, 1000);
+  __atomic_store_n(&hold.released, 1, __ATOMIC_RELEASE);
+  pool_wait(&task);
+  pool_stop();
+  pthread_getaffinity_np(pthread_self(), sizeof(after), &after);
+
+  if(rows != 1000 || hold.timed_out) {
+    printf("FAIL:  %ld of 1000 band rows ran%s\n", rows,
+           hold.timed_out ? ", waiting on a busy worker" : "");
+    exit(1);
+  }
+  if(CPU_COUNT(&during) != 1 || !CPU_EQUAL(&before, &after)) {
+    printf("FAIL:  starting thread on %d CPUs in the pool, %d of %d after\n",
+           CPU_COUNT(&during), CPU_COUNT(&after), CPU_COUNT(&before));
+    exit(1);
+  }
+  printf("numa bands:  ok\n");
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t seed = argc > 1 ? strtoull(argv[1], NULL, 0) : 1;
+  size_t dim = argc > 2 ? strtoull(argv[2], NULL, 0) : 128;
+
+  // More threads than most test machines have CPUs, so banded passes split.
+  _require(pool_start(4, POOL_FLOAT));
+  _check_rand_streams();
+  _check_rough_gen();
+  _check_dirty_erode(seed, dim);
+  _check_distributed_erode(seed, dim);
+  _check_mip_chain(seed, dim);
+  pool_stop();
+  _check_numa_bands();
+  return 0;
+}